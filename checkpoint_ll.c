@@ -0,0 +1,478 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * checkpoint_ll.c - asynchronous checkpoints of a regular_ll list into a
+ * pmemobj pool
+ *
+ * The DRAM list serves all traffic and journals its inserts and deletes. A
+ * background thread periodically takes the journal and applies it to a
+ * persistent copy of the list, laid out as list_node chains like pmem_ll.c,
+ * in one transaction per checkpoint. A crash loses at most the changes made
+ * since the last checkpoint.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "checkpoint_ll.h"
+
+POBJ_LAYOUT_BEGIN(checkpoint);
+POBJ_LAYOUT_ROOT(checkpoint, struct checkpoint_root);
+POBJ_LAYOUT_TOID(checkpoint, struct list_node);
+POBJ_LAYOUT_END(checkpoint);
+
+struct list_node {
+    int value;
+    _Atomic(TOID(struct list_node)) next;
+};
+
+/*
+ * Deleted values are marked in the low bit of next, as in pmem_ll.c, and
+ * skipped on restore. Marked nodes are unlinked by the checkpoint that sees
+ * them outnumber the live ones, once there are CHECKPOINT_COMPACT_MIN.
+ */
+#define CHECKPOINT_COMPACT_MIN 1024
+
+struct checkpoint_root {
+    TOID(struct list_node) head;
+    TOID(struct list_node) tail;
+    uint64_t seq;
+    uint64_t live;
+    uint64_t marked;
+};
+
+// live persistent nodes by value, so a delete finds a node to mark without
+// walking the list
+#define INDEX_BUCKETS (1 << 16)
+
+struct index_entry {
+    int value;
+    TOID(struct list_node) node;
+    struct index_entry *next;
+};
+
+struct checkpointer {
+    PMEMobjpool *pop;
+    TOID(struct checkpoint_root) root;
+    Node *head;
+    unsigned interval_ms;
+    pthread_mutex_t lock; // one checkpoint at a time; guards stop
+    pthread_cond_t wake;
+    bool stop;
+    pthread_t thread;
+    struct index_entry *index[INDEX_BUCKETS];
+};
+
+// get next ptr without the marked node
+static inline Node *getNextPtr(Node *node) {
+    return (Node *)((uintptr_t)atomic_load(&node->next) & ~0x1);
+}
+
+// check if the given node is marked
+static inline bool isMarked(Node *node) {
+    return (uintptr_t)atomic_load(&node->next) & 0x1;
+}
+
+// next persistent node without the marked bit
+static inline TOID(struct list_node) getNextNode(TOID(struct list_node) node) {
+    TOID(struct list_node) next = atomic_load(&D_RO(node)->next);
+    next.oid.off &= ~(uint64_t)0x1;
+    return next;
+}
+
+// check if the given persistent node is marked as deleted
+static inline bool isNodeMarked(TOID(struct list_node) node) {
+    TOID(struct list_node) next = atomic_load(&D_RO(node)->next);
+    return next.oid.off & 0x1;
+}
+
+static inline size_t indexBucket(int value) {
+    return ((uint32_t)value * 2654435761u) >> 16;
+}
+
+static void indexAdd(Checkpointer *c, int value, TOID(struct list_node) node) {
+    struct index_entry *entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        perror("Failed to allocate checkpoint index entry");
+        exit(EXIT_FAILURE);
+    }
+    size_t bucket = indexBucket(value);
+    entry->value = value;
+    entry->node = node;
+    entry->next = c->index[bucket];
+    c->index[bucket] = entry;
+}
+
+// remove and return some live node holding value, or TOID_NULL
+static TOID(struct list_node) indexTake(Checkpointer *c, int value) {
+    struct index_entry **link = &c->index[indexBucket(value)];
+    while (*link != NULL && (*link)->value != value) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return TOID_NULL(struct list_node);
+    }
+
+    struct index_entry *entry = *link;
+    TOID(struct list_node) node = entry->node;
+    *link = entry->next;
+    free(entry);
+    return node;
+}
+
+static void indexClear(Checkpointer *c) {
+    for (size_t i = 0; i < INDEX_BUCKETS; i++) {
+        struct index_entry *entry = c->index[i];
+        while (entry != NULL) {
+            struct index_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        c->index[i] = NULL;
+    }
+}
+
+static void indexCheckpoint(Checkpointer *c) {
+    indexClear(c);
+    for (TOID(struct list_node) node = D_RO(c->root)->head;
+         !TOID_IS_NULL(node); node = getNextNode(node)) {
+        if (!isNodeMarked(node)) {
+            indexAdd(c, D_RO(node)->value, node);
+        }
+    }
+}
+
+/*
+ * The helpers below run inside an open transaction that has already added
+ * the whole checkpoint root.
+ */
+
+// append a new node after the tail, keeping the tail's mark
+static TOID(struct list_node) appendCheckpointNode(
+    TOID(struct checkpoint_root) root, int value) {
+    struct checkpoint_root *r = D_RW(root);
+    TOID(struct list_node) node = TX_NEW(struct list_node);
+    D_RW(node)->value = value;
+    atomic_store(&D_RW(node)->next, TOID_NULL(struct list_node));
+
+    if (TOID_IS_NULL(r->tail)) {
+        r->head = node;
+    } else {
+        TOID(struct list_node) next = node;
+        if (isNodeMarked(r->tail)) {
+            next.oid.off |= 0x1;
+        }
+        TX_ADD_FIELD(r->tail, next);
+        atomic_store(&D_RW(r->tail)->next, next);
+    }
+    r->tail = node;
+    r->live++;
+    return node;
+}
+
+static void markCheckpointNode(TOID(struct checkpoint_root) root,
+                               TOID(struct list_node) node) {
+    TOID(struct list_node) next = getNextNode(node);
+    next.oid.off |= 0x1;
+    TX_ADD_FIELD(node, next);
+    atomic_store(&D_RW(node)->next, next);
+    D_RW(root)->live--;
+    D_RW(root)->marked++;
+}
+
+// unlink and free every marked node
+static void compactCheckpoint(TOID(struct checkpoint_root) root) {
+    struct checkpoint_root *r = D_RW(root);
+    TOID(struct list_node) prev = TOID_NULL(struct list_node);
+    TOID(struct list_node) curr = r->head;
+
+    while (!TOID_IS_NULL(curr)) {
+        TOID(struct list_node) next = getNextNode(curr);
+        if (isNodeMarked(curr)) {
+            if (TOID_IS_NULL(prev)) {
+                r->head = next;
+            } else {
+                TX_ADD_FIELD(prev, next);
+                atomic_store(&D_RW(prev)->next, next);
+            }
+            TX_FREE(curr);
+        } else {
+            prev = curr;
+        }
+        curr = next;
+    }
+    r->tail = prev;
+    r->marked = 0;
+}
+
+static int compareValues(const void *a, const void *b) {
+    int va = *(const int *)a, vb = *(const int *)b;
+    return (va > vb) - (va < vb);
+}
+
+// the checkpoint and the DRAM list hold the same live values. They are
+// compared as multisets: the journal does not order changes made by
+// different threads, so the checkpoint's order drifts from the DRAM list's
+static bool checkpointMatches(Checkpointer *c) {
+    size_t n = 0, m = 0;
+
+    for (Node *curr = c->head; curr != NULL; curr = getNextPtr(curr)) {
+        if (!isMarked(curr)) {
+            n++;
+        }
+    }
+    if (n != D_RO(c->root)->live) {
+        return false;
+    }
+
+    int *saved = malloc((n + 1) * sizeof(int));
+    int *current = malloc((n + 1) * sizeof(int));
+    if (saved == NULL || current == NULL) {
+        perror("Failed to allocate checkpoint comparison");
+        exit(EXIT_FAILURE);
+    }
+    for (TOID(struct list_node) node = D_RO(c->root)->head;
+         !TOID_IS_NULL(node) && m <= n; node = getNextNode(node)) {
+        if (!isNodeMarked(node)) {
+            saved[m++] = D_RO(node)->value;
+        }
+    }
+    n = 0;
+    for (Node *curr = c->head; curr != NULL; curr = getNextPtr(curr)) {
+        if (!isMarked(curr)) {
+            current[n++] = curr->value;
+        }
+    }
+
+    bool matches = m == n;
+    if (matches) {
+        qsort(saved, n, sizeof(int), compareValues);
+        qsort(current, n, sizeof(int), compareValues);
+        matches = memcmp(saved, current, n * sizeof(int)) == 0;
+    }
+    free(saved);
+    free(current);
+    return matches;
+}
+
+// replace the checkpoint with a full copy of the DRAM list
+static void writeBaseCheckpoint(Checkpointer *c) {
+    TX_BEGIN(c->pop) {
+        TX_ADD(c->root);
+        struct checkpoint_root *r = D_RW(c->root);
+
+        TOID(struct list_node) node = r->head;
+        while (!TOID_IS_NULL(node)) {
+            TOID(struct list_node) next = getNextNode(node);
+            TX_FREE(node);
+            node = next;
+        }
+        r->head = TOID_NULL(struct list_node);
+        r->tail = TOID_NULL(struct list_node);
+        r->live = 0;
+        r->marked = 0;
+
+        for (Node *curr = c->head; curr != NULL; curr = getNextPtr(curr)) {
+            if (!isMarked(curr)) {
+                appendCheckpointNode(c->root, curr->value);
+            }
+        }
+        r->seq++;
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Writing the base checkpoint aborted\n");
+        abort();
+    }
+    TX_END
+}
+
+// apply every change journaled since the last checkpoint in one transaction;
+// called with c->lock held. The journal does not order changes made by
+// different threads, so the inserts are applied before the deletes, which
+// then always find the node they undo
+static uint64_t writeCheckpoint(Checkpointer *c) {
+    ChangeBlock *changes = takeListChanges(c->head);
+    if (changes == NULL) {
+        return D_RO(c->root)->seq;
+    }
+
+    TX_BEGIN(c->pop) {
+        TX_ADD(c->root);
+        struct checkpoint_root *r = D_RW(c->root);
+
+        for (ChangeBlock *block = changes; block != NULL;
+             block = block->next) {
+            for (size_t i = 0; i < block->count; i++) {
+                const Change *change = &block->changes[i];
+                if (change->inserted) {
+                    TOID(struct list_node) node =
+                        appendCheckpointNode(c->root, change->value);
+                    indexAdd(c, change->value, node);
+                }
+            }
+        }
+        for (ChangeBlock *block = changes; block != NULL;
+             block = block->next) {
+            for (size_t i = 0; i < block->count; i++) {
+                const Change *change = &block->changes[i];
+                if (!change->inserted) {
+                    TOID(struct list_node) node = indexTake(c, change->value);
+                    if (!TOID_IS_NULL(node)) {
+                        markCheckpointNode(c->root, node);
+                    }
+                }
+            }
+        }
+
+        if (r->marked >= CHECKPOINT_COMPACT_MIN && r->marked > r->live) {
+            compactCheckpoint(c->root);
+        }
+        r->seq++;
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Checkpoint %" PRIu64 " aborted\n",
+                D_RO(c->root)->seq + 1);
+        abort();
+    }
+    TX_END
+
+    freeChanges(changes);
+    return D_RO(c->root)->seq;
+}
+
+static void *checkpointThread(void *arg) {
+    Checkpointer *c = arg;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += c->interval_ms / 1000;
+        deadline.tv_nsec += (long)(c->interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int rc = 0;
+        while (!c->stop && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&c->wake, &c->lock, &deadline);
+        }
+        if (!c->stop) {
+            writeCheckpoint(c);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+// open the checkpoint pool at path, creating it with size bytes (at least
+// PMEMOBJ_MIN_POOL) if it does not exist yet
+PMEMobjpool *openCheckpointPool(const char *path, size_t size) {
+    struct stat buffer;
+
+    if (stat(path, &buffer) == 0) {
+        return pmemobj_open(path, POBJ_LAYOUT_NAME(checkpoint));
+    }
+    if (size < PMEMOBJ_MIN_POOL) {
+        size = PMEMOBJ_MIN_POOL;
+    }
+    return pmemobj_create(path, POBJ_LAYOUT_NAME(checkpoint), size, 0666);
+}
+
+// rebuild the list from the latest checkpoint; an empty checkpoint gives the
+// head of an empty list
+Node *restoreCheckpoint(PMEMobjpool *pop) {
+    TOID(struct checkpoint_root) root = POBJ_ROOT(pop, struct checkpoint_root);
+    Node *head = NULL, *tail = NULL;
+
+    for (TOID(struct list_node) node = D_RO(root)->head; !TOID_IS_NULL(node);
+         node = getNextNode(node)) {
+        if (isNodeMarked(node)) {
+            continue;
+        }
+        Node *restored = createNode(D_RO(node)->value);
+        if (tail == NULL) {
+            head = restored;
+        } else {
+            atomic_store(&tail->next, restored);
+        }
+        tail = restored;
+    }
+
+    return head != NULL ? head : createEmptyList();
+}
+
+/*
+ * Start checkpointing the list every interval_ms, or only on checkpointNow
+ * and destroyCheckpointer if interval_ms is 0. Call before the list is
+ * shared between threads. Unless the list holds the same values as the
+ * checkpoint, e.g. because it was just restored from this pool, a full copy
+ * of it is written first. Returns NULL if the list is already journaled,
+ * e.g. by another checkpointer.
+ */
+Checkpointer *createCheckpointer(PMEMobjpool *pop, Node *head,
+                                 unsigned interval_ms) {
+    if (!trackListChanges(head)) {
+        return NULL;
+    }
+
+    Checkpointer *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        perror("Failed to allocate checkpointer");
+        exit(EXIT_FAILURE);
+    }
+    c->pop = pop;
+    c->root = POBJ_ROOT(pop, struct checkpoint_root);
+    c->head = head;
+    c->interval_ms = interval_ms;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+
+    if (!checkpointMatches(c)) {
+        writeBaseCheckpoint(c);
+    }
+    indexCheckpoint(c);
+
+    if (interval_ms > 0 &&
+        pthread_create(&c->thread, NULL, checkpointThread, c) != 0) {
+        perror("Failed to start checkpoint thread");
+        exit(EXIT_FAILURE);
+    }
+    return c;
+}
+
+// write a checkpoint now; returns its sequence number
+uint64_t checkpointNow(Checkpointer *c) {
+    pthread_mutex_lock(&c->lock);
+    uint64_t seq = writeCheckpoint(c);
+    pthread_mutex_unlock(&c->lock);
+    return seq;
+}
+
+// stop the background thread after a final checkpoint; no other thread may
+// be using the list
+void destroyCheckpointer(Checkpointer *c) {
+    if (c->interval_ms > 0) {
+        pthread_mutex_lock(&c->lock);
+        c->stop = true;
+        pthread_cond_signal(&c->wake);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->thread, NULL);
+    }
+
+    writeCheckpoint(c);
+    untrackListChanges(c->head);
+    indexClear(c);
+    pthread_cond_destroy(&c->wake);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
@@ -0,0 +1,23 @@
+#ifndef CHECKPOINT_LL_H
+#define CHECKPOINT_LL_H
+
+#include <libpmemobj.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "regular_ll.h"
+
+typedef struct checkpointer Checkpointer;
+
+PMEMobjpool *openCheckpointPool(const char *path, size_t size);
+
+Node *restoreCheckpoint(PMEMobjpool *pop);
+
+Checkpointer *createCheckpointer(PMEMobjpool *pop, Node *head,
+                                 unsigned interval_ms);
+
+uint64_t checkpointNow(Checkpointer *checkpointer);
+
+void destroyCheckpointer(Checkpointer *checkpointer);
+
+#endif /* CHECKPOINT_LL_H */
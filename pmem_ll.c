@@ -4,19 +4,36 @@
 /*
  * persistent_lockfree_list.c - example of persistent lock-free linked list
  */
+#define _GNU_SOURCE // pthread_rwlockattr_setkind_np
 #include "pmemobj_list.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-POBJ_LAYOUT_BEGIN(list);
-POBJ_LAYOUT_ROOT(list, struct list_root);
-POBJ_LAYOUT_TOID(list, struct list_node);
-POBJ_LAYOUT_END(list);
+/*
+ * The layout name is versioned: bump it whenever the root struct or the order
+ * of the type numbers below changes, so pmemobj_open refuses an older pool
+ * instead of reading its objects with the wrong types. "list" was the layout
+ * with a bare list_root as the root object and list_node as type 1.
+ */
+POBJ_LAYOUT_BEGIN(list_v2);
+POBJ_LAYOUT_ROOT(list_v2, struct pool_root);
+POBJ_LAYOUT_TOID(list_v2, struct list_root);
+POBJ_LAYOUT_TOID(list_v2, struct list_node);
+POBJ_LAYOUT_TOID(list_v2, struct op_log);
+POBJ_LAYOUT_TOID(list_v2, struct list_filters);
+POBJ_LAYOUT_TOID(list_v2, struct list_dir);
+POBJ_LAYOUT_TOID(list_v2, struct list_dir_entry);
+POBJ_LAYOUT_END(list_v2);
 
 bool file_exists(const char *filename) {
     struct stat buffer;
@@ -27,14 +44,101 @@ struct list_node {
     _Atomic(TOID(struct list_node)) next;
 };
 
+/*
+ * Redo log used by the group-commit path. Each entry is packed into a single
+ * 8-byte word (epoch:31 | op:1 | value:32) so it is written failure-atomically.
+ * Entries are live only while their epoch is the one after log.epoch; the
+ * transaction that applies a batch advances log.epoch, retiring them.
+ */
+#define OPLOG_CAPACITY 64
+#define OPLOG_EPOCH_MASK 0x7fffffffULL
+
+enum oplog_op { OPLOG_INSERT = 0, OPLOG_DELETE = 1 };
+
+struct op_log {
+    uint64_t epoch;
+    uint64_t entries[OPLOG_CAPACITY];
+};
+
+/*
+ * Optional Bloom filter answering "definitely not in the list". Two filters
+ * are kept: lookups and inserts use sets[gen & 1], while a rebuild refills
+ * the other one from the live nodes and then bumps gen. gen == 0 means the
+ * filter has never been built and is not consulted.
+ */
+#define FILTER_WORDS (1 << 14)
+#define FILTER_BITS ((uint64_t)FILTER_WORDS * 64)
+#define FILTER_HASHES 4
+
+struct list_filter {
+    _Atomic uint64_t bits[FILTER_WORDS];
+};
+
+struct list_filters {
+    _Atomic uint64_t gen;
+    _Atomic uint64_t rebuilding;
+    struct list_filter sets[2];
+};
+
+/*
+ * Directory of named lists, hanging off the pool's root object. Each named
+ * list is a separately allocated list_root, found through a fixed-size hash
+ * table of chained entries.
+ */
+#define LIST_NAME_MAX 32
+#define LIST_DIR_BUCKETS 4096
+
+struct list_dir_entry {
+    char name[LIST_NAME_MAX];
+    TOID(struct list_root) list;
+    TOID(struct list_dir_entry) next;
+};
+
+struct list_dir {
+    uint64_t count;
+    TOID(struct list_dir_entry) buckets[LIST_DIR_BUCKETS];
+};
+
+/*
+ * Root of a list. The op log and the filter are only needed by lists that
+ * use group commit or attachFilter, so they are allocated on first use and
+ * a list that uses neither costs little more than its nodes.
+ */
 struct list_root {
     TOID(struct list_node) head;
+    TOID(struct op_log) log;
+    TOID(struct list_filters) filter;
+    // node counts written back by closeLists, trusted by the next open of
+    // the list only while counts_valid is set
+    int64_t live;
+    int64_t marked;
+    uint64_t counts_valid;
 };
 
+/*
+ * The pool's root object: the pool's own list, placed first so the root oid
+ * is also the oid of that list, followed by the pool-wide state.
+ * clean_shutdown tells the next open whether closeLists ran. dropping is a
+ * named list that dropNamedList has unlinked but not finished freeing.
+ */
+struct pool_root {
+    struct list_root list;
+    TOID(struct list_dir) dir;
+    uint64_t clean_shutdown;
+    TOID(struct list_root) dropping;
+};
+
+static inline TOID(struct list_root) poolList(TOID(struct pool_root) pool) {
+    TOID(struct list_root) list;
+    TOID_ASSIGN(list, pool.oid);
+    return list;
+}
+
 // Get next pointer without the marked bit
 static inline TOID(struct list_node) getNextPtr(TOID(struct list_node) node) {
     TOID(struct list_node) next = atomic_load(&D_RW(node)->next);
-    return TOID_ASSIGN(struct list_node, ((uintptr_t)next.oid.off & ~0x1));
+    next.oid.off &= ~(uint64_t)0x3;
+    return next;
 }
 
 // Check if the given node is marked for deletion
@@ -45,239 +149,2525 @@ static inline bool isMarked(TOID(struct list_node) node) {
 
 // Get a marked pointer for the given node
 static inline TOID(struct list_node) getMarkedPtr(TOID(struct list_node) node) {
-    PMEMoid oid = node.oid;
-    oid.off = (uintptr_t)oid.off | 0x1;
-    return TOID_ASSIGN(struct list_node, oid);
+    node.oid.off |= 0x1;
+    return node;
+}
+
+/*
+ * Epoch-based reclamation, as in regular_ll.c. A node unlinked while other
+ * threads may still be walking over it is retired instead of freed, and only
+ * handed to TX_FREE once the global epoch has moved on twice, so its memory
+ * cannot be reused under a running walk. The unlink transaction also sets
+ * NODE_DETACHED in the node's next field; retired nodes live in DRAM only,
+ * so recoverLists frees the detached nodes a crash left behind.
+ */
+#define NODE_DETACHED 0x2
+#define RETIRE_BATCH 64
+
+struct node_batch {
+    TOID(struct list_node) *nodes;
+    size_t count;
+    size_t capacity;
+    uint64_t epoch;
+};
+
+// per-thread state, handed back by a key destructor when the thread exits;
+// retired nodes stay with the record and are freed by its next owner
+struct epoch_record {
+    _Alignas(64) _Atomic uint64_t epoch; // (epoch << 1 | 1) inside a walk
+    int nesting;
+    atomic_bool in_use;
+    size_t retired_since_advance;
+    struct node_batch retired[3];
+    struct epoch_record *next;
+};
+
+static _Atomic(struct epoch_record *) epochRecords;
+static _Atomic uint64_t globalEpoch;
+static pthread_key_t epochRecordKey;
+static pthread_once_t epochRecordOnce = PTHREAD_ONCE_INIT;
+static _Thread_local struct epoch_record *epochRecord;
+
+static void releaseEpochRecord(void *arg) {
+    struct epoch_record *rec = arg;
+    atomic_store(&rec->epoch, 0);
+    atomic_store(&rec->in_use, false);
+}
+
+static void createEpochRecordKey(void) {
+    pthread_key_create(&epochRecordKey, releaseEpochRecord);
+}
+
+static struct epoch_record *getEpochRecord(void) {
+    if (epochRecord != NULL) {
+        return epochRecord;
+    }
+    pthread_once(&epochRecordOnce, createEpochRecordKey);
+
+    struct epoch_record *rec;
+    for (rec = atomic_load(&epochRecords); rec != NULL; rec = rec->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&rec->in_use, &expected, true)) {
+            break;
+        }
+    }
+    if (rec == NULL) {
+        rec = aligned_alloc(64, sizeof(*rec));
+        if (rec == NULL) {
+            perror("Failed to allocate memory for epoch record");
+            exit(EXIT_FAILURE);
+        }
+        memset(rec, 0, sizeof(*rec));
+        atomic_store(&rec->in_use, true);
+        rec->next = atomic_load(&epochRecords);
+        while (!atomic_compare_exchange_weak(&epochRecords, &rec->next, rec)) {
+        }
+    }
+
+    pthread_setspecific(epochRecordKey, rec);
+    epochRecord = rec;
+    return rec;
+}
+
+static void appendNode(struct node_batch *batch, TOID(struct list_node) node) {
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity > 0 ? 2 * batch->capacity : 16;
+        TOID(struct list_node) *nodes =
+            realloc(batch->nodes, capacity * sizeof(*nodes));
+        if (nodes == NULL) {
+            perror("Failed to allocate memory for retired nodes");
+            exit(EXIT_FAILURE);
+        }
+        batch->nodes = nodes;
+        batch->capacity = capacity;
+    }
+    batch->nodes[batch->count++] = node;
+}
+
+/*
+ * TX_FREE the batch, one transaction per run of nodes from the same pool.
+ * Nothing is freed from inside another transaction, since the nodes may
+ * belong to a different pool; the batch is kept for a later attempt.
+ */
+static void freeNodes(struct node_batch *batch) {
+    if (pmemobj_tx_stage() != TX_STAGE_NONE) {
+        return;
+    }
+
+    size_t start = 0;
+    while (start < batch->count) {
+        TOID(struct list_node) *nodes = batch->nodes;
+        uint64_t pool = nodes[start].oid.pool_uuid_lo;
+        size_t end = start + 1;
+        while (end < batch->count && nodes[end].oid.pool_uuid_lo == pool) {
+            end++;
+        }
+
+        TX_BEGIN(pmemobj_pool_by_oid(nodes[start].oid)) {
+            for (size_t i = start; i < end; i++) {
+                TX_FREE(nodes[i]);
+            }
+        }
+        TX_ONABORT {
+            fprintf(stderr, "Transaction aborted when freeing nodes\n");
+            abort();
+        }
+        TX_END
+        start = end;
+    }
+    batch->count = 0;
+}
+
+static void reclaimRetired(struct epoch_record *rec) {
+    uint64_t epoch = atomic_load(&globalEpoch);
+    for (int i = 0; i < 3; i++) {
+        if (rec->retired[i].count > 0 && rec->retired[i].epoch + 2 <= epoch) {
+            freeNodes(&rec->retired[i]);
+        }
+    }
+}
+
+// move the global epoch on if every thread inside a walk has announced it
+static void advanceEpoch(void) {
+    uint64_t epoch = atomic_load(&globalEpoch);
+    for (struct epoch_record *rec = atomic_load(&epochRecords); rec != NULL;
+         rec = rec->next) {
+        uint64_t seen = atomic_load(&rec->epoch);
+        if ((seen & 1) && (seen >> 1) != epoch) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&globalEpoch, &epoch, epoch + 1);
+}
+
+static struct epoch_record *enterEpoch(void) {
+    struct epoch_record *rec = getEpochRecord();
+    if (rec->nesting++ == 0) {
+        atomic_store(&rec->epoch, atomic_load(&globalEpoch) << 1 | 1);
+        reclaimRetired(rec);
+    }
+    return rec;
+}
+
+static void exitEpoch(struct epoch_record *rec) {
+    if (--rec->nesting == 0) {
+        atomic_store_explicit(&rec->epoch, 0, memory_order_release);
+    }
+}
+
+// free the nodes, unlinked by a committed transaction, once no walk can
+// still be reading them
+static void retireNodes(const struct node_batch *unlinked) {
+    if (unlinked->count == 0) {
+        return;
+    }
+
+    struct epoch_record *rec = getEpochRecord();
+    uint64_t epoch = atomic_load(&globalEpoch);
+    struct node_batch *batch = &rec->retired[epoch % 3];
+
+    // a batch left over from epoch - 3 or earlier is already safe to free;
+    // if it cannot be freed now it is kept and waits for the new epoch
+    if (batch->count > 0 && batch->epoch != epoch) {
+        freeNodes(batch);
+    }
+    for (size_t i = 0; i < unlinked->count; i++) {
+        appendNode(batch, unlinked->nodes[i]);
+    }
+    batch->epoch = epoch;
+
+    rec->retired_since_advance += unlinked->count;
+    if (rec->retired_since_advance >= RETIRE_BATCH) {
+        rec->retired_since_advance = 0;
+        advanceEpoch();
+        reclaimRetired(rec);
+    }
+}
+
+static void retireNode(TOID(struct list_node) node) {
+    struct node_batch unlinked = {&node, 1, 1, 0};
+    retireNodes(&unlinked);
+}
+
+/*
+ * Free every retired node of the pool right away. Only safe once no thread
+ * walks a list of the pool any more, i.e. from closeLists.
+ */
+static void freePoolRetired(PMEMobjpool *pop) {
+    struct node_batch own = {NULL, 0, 0, 0};
+
+    for (struct epoch_record *rec = atomic_load(&epochRecords); rec != NULL;
+         rec = rec->next) {
+        for (int i = 0; i < 3; i++) {
+            struct node_batch *batch = &rec->retired[i];
+            size_t kept = 0;
+            for (size_t j = 0; j < batch->count; j++) {
+                if (pmemobj_pool_by_oid(batch->nodes[j].oid) == pop) {
+                    appendNode(&own, batch->nodes[j]);
+                } else {
+                    batch->nodes[kept++] = batch->nodes[j];
+                }
+            }
+            batch->count = kept;
+        }
+    }
+
+    freeNodes(&own);
+    free(own.nodes);
+}
+
+/*
+ * Tag the marked node as unlinked from inside the transaction that unlinks
+ * it. Only the thread whose CAS on the predecessor (or, for the head, that
+ * holds head_lock) unlinked the node gets here, and nothing else writes the
+ * next field of a marked node, so a plain store is enough.
+ */
+static void detachNodeInTx(TOID(struct list_node) node) {
+    TOID(struct list_node) next = atomic_load(&D_RW(node)->next);
+
+    next.oid.off |= NODE_DETACHED;
+    TX_ADD_FIELD(node, next);
+    atomic_store(&D_RW(node)->next, next);
+}
+
+// free the nodes a crash left detached but not yet reclaimed
+static void freeDetachedNodes(PMEMobjpool *pop) {
+    TOID(struct list_node) node;
+
+    TX_BEGIN(pop) {
+        POBJ_FOREACH_TYPE(pop, node) {
+            TOID(struct list_node) next = atomic_load(&D_RW(node)->next);
+            if (next.oid.off & NODE_DETACHED) {
+                TX_FREE(node);
+            }
+        }
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Transaction aborted when freeing detached nodes\n");
+        abort();
+    }
+    TX_END
+}
+
+/*
+ * DRAM state of every list used by this process, found by the oid of its
+ * list_root in a fixed-size hash table. Entries are created on first use and
+ * published with a CAS, so lookups take no lock; they are never freed, as a
+ * dropped list's entry may still be read by a lookup for another list in the
+ * same bucket.
+ */
+#define LIST_STATE_BUCKETS 1024
+
+/*
+ * Live and marked node counts, split into cache-line sized shards so threads
+ * updating them do not share a line. They are kept in DRAM and written to
+ * the list's root by closeLists.
+ */
+#define COUNTER_SHARDS 8
+
+struct counter_shard {
+    _Alignas(64) _Atomic int64_t live;
+    _Atomic int64_t marked;
+};
+
+struct list_state {
+    PMEMoid root;
+    // root->head is not swung with a CAS, so every transaction that may
+    // write it holds head_lock until it has ended
+    pthread_mutex_t head_lock;
+    // held shared by everything that marks or frees nodes and exclusively by
+    // exportSnapshot, so no node stops being live while an export walks
+    pthread_rwlock_t delete_lock;
+    pthread_rwlock_t filter_lock;
+    pthread_mutex_t filter_rebuild_lock;
+    // set while the list is open in this session, so closeLists writes its
+    // counts back
+    bool opened;
+    struct counter_shard counters[COUNTER_SHARDS];
+    struct list_state *next;
+};
+
+static _Atomic(struct list_state *) listStates[LIST_STATE_BUCKETS];
+
+// an export must not be starved by a steady stream of deletes
+static pthread_rwlockattr_t deleteLockAttr;
+static pthread_once_t deleteLockAttrOnce = PTHREAD_ONCE_INIT;
+
+static void initDeleteLockAttr(void) {
+    pthread_rwlockattr_init(&deleteLockAttr);
+    pthread_rwlockattr_setkind_np(&deleteLockAttr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+}
+
+static struct list_state *listState(TOID(struct list_root) root) {
+    uint64_t h = (root.oid.off >> 6) ^ root.oid.pool_uuid_lo;
+    _Atomic(struct list_state *) *bucket =
+        &listStates[(h ^ (h >> 32)) % LIST_STATE_BUCKETS];
+
+    struct list_state *head = atomic_load(bucket);
+    for (struct list_state *state = head; state != NULL;
+         state = state->next) {
+        if (OID_EQUALS(state->root, root.oid)) {
+            return state;
+        }
+    }
+
+    pthread_once(&deleteLockAttrOnce, initDeleteLockAttr);
+    struct list_state *state = aligned_alloc(64, sizeof(*state));
+    if (state == NULL) {
+        perror("Failed to allocate memory for list state");
+        exit(EXIT_FAILURE);
+    }
+    memset(state, 0, sizeof(*state));
+    state->root = root.oid;
+    pthread_mutex_init(&state->head_lock, NULL);
+    pthread_rwlock_init(&state->delete_lock, &deleteLockAttr);
+    pthread_rwlock_init(&state->filter_lock, NULL);
+    pthread_mutex_init(&state->filter_rebuild_lock, NULL);
+
+    // entries only ever go in front, so on a failed CAS just the new ones
+    // need to be checked for a racing insert of the same root
+    while (true) {
+        state->next = head;
+        if (atomic_compare_exchange_weak(bucket, &state->next, state)) {
+            return state;
+        }
+        struct list_state *seen = state->next;
+        for (struct list_state *s = seen; s != head; s = s->next) {
+            if (OID_EQUALS(s->root, root.oid)) {
+                pthread_mutex_destroy(&state->head_lock);
+                pthread_rwlock_destroy(&state->delete_lock);
+                pthread_rwlock_destroy(&state->filter_lock);
+                pthread_mutex_destroy(&state->filter_rebuild_lock);
+                free(state);
+                return s;
+            }
+        }
+        head = seen;
+    }
+}
+
+static atomic_int nextCounterShard;
+static _Thread_local int counterShard = -1;
+
+// adjust the counts of the list from the calling thread's shard
+static void countNodes(TOID(struct list_root) root, int64_t live,
+                       int64_t marked) {
+    if (counterShard == -1) {
+        counterShard = atomic_fetch_add(&nextCounterShard, 1) % COUNTER_SHARDS;
+    }
+    struct counter_shard *shard = &listState(root)->counters[counterShard];
+    if (live != 0) {
+        atomic_fetch_add_explicit(&shard->live, live, memory_order_relaxed);
+    }
+    if (marked != 0) {
+        atomic_fetch_add_explicit(&shard->marked, marked,
+                                  memory_order_relaxed);
+    }
+}
+
+// O(1) size query: sum the shards of the list
+void listSize(TOID(struct list_root) root, int64_t *live, int64_t *marked) {
+    struct list_state *state = listState(root);
+    *live = 0;
+    *marked = 0;
+    for (int i = 0; i < COUNTER_SHARDS; i++) {
+        *live += atomic_load(&state->counters[i].live);
+        *marked += atomic_load(&state->counters[i].marked);
+    }
+}
+
+static void setCounts(struct list_state *state, int64_t live,
+                      int64_t marked) {
+    for (int i = 0; i < COUNTER_SHARDS; i++) {
+        atomic_store(&state->counters[i].live, i == 0 ? live : 0);
+        atomic_store(&state->counters[i].marked, i == 0 ? marked : 0);
+    }
+}
+
+// rebuild the counts from a full traversal, used when they are not durable
+static void recountList(TOID(struct list_root) root) {
+    int64_t live = 0, marked = 0;
+
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) curr = D_RO(root)->head;
+    while (!TOID_IS_NULL(curr)) {
+        if (isMarked(curr)) {
+            marked++;
+        } else {
+            live++;
+        }
+        curr = getNextPtr(curr);
+    }
+    exitEpoch(rec);
+
+    setCounts(listState(root), live, marked);
+}
+
+TOID(struct list_node) createPersistentNode(PMEMobjpool *pop, int value) {
+    TOID(struct list_node) node;
+
+    TX_BEGIN(pop) {
+        node = TX_NEW(struct list_node);
+        TX_ADD_DIRECT(&D_RW(node)->value);
+        D_RW(node)->value = value;
+        TX_ADD_DIRECT(&D_RW(node)->next);
+        atomic_store(&D_RW(node)->next, TOID_NULL(struct list_node));
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Transaction aborted when creating node\n");
+        abort();
+    }
+    TX_END
+
+    return node;
+}
+
+/*
+ * Inserts hold the list's filter_lock shared from the moment they set their
+ * filter bits until their node is linked. A rebuild takes it exclusively to
+ * start adding inserts to the shadow filter and again to flip its gen, so
+ * every node is either seen by the rebuild walk or has its bits in the new
+ * filter. Both locks are per list, so a rebuild only holds up inserts into
+ * the list being rebuilt.
+ */
+
+static inline bool filterAttached(TOID(struct list_root) root) {
+    return !TOID_IS_NULL(D_RO(root)->filter);
+}
+
+static inline uint64_t filterHash(int value) {
+    uint64_t h = (uint32_t)value;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+// set the bits for value in f, flushing each touched word if pop is given
+static void filterSetBits(PMEMobjpool *pop, struct list_filter *f, int value) {
+    uint64_t h = filterHash(value);
+    uint64_t step = (h >> 32) | 1;
+
+    for (int i = 0; i < FILTER_HASHES; i++) {
+        uint64_t bit = (h + i * step) & (FILTER_BITS - 1);
+        atomic_fetch_or(&f->bits[bit / 64], 1ULL << (bit % 64));
+        if (pop != NULL) {
+            pmemobj_flush(pop, &f->bits[bit / 64], sizeof(f->bits[0]));
+        }
+    }
+}
+
+// make value's bits durable before its node can become reachable
+static void filterAddValue(PMEMobjpool *pop, TOID(struct list_root) root,
+                           int value) {
+    struct list_filters *filter = D_RW(D_RO(root)->filter);
+    uint64_t gen = atomic_load(&filter->gen);
+
+    filterSetBits(pop, &filter->sets[gen & 1], value);
+    if (atomic_load(&filter->rebuilding)) {
+        filterSetBits(pop, &filter->sets[(gen + 1) & 1], value);
+    }
+    pmemobj_drain(pop);
+}
+
+// false only if value is definitely not in the list
+static bool filterMayContain(TOID(struct list_root) root, int value) {
+    if (!filterAttached(root)) {
+        return true;
+    }
+    struct list_filters *filter = D_RW(D_RO(root)->filter);
+    uint64_t gen = atomic_load(&filter->gen);
+    if (gen == 0) {
+        return true;
+    }
+
+    const struct list_filter *f = &filter->sets[gen & 1];
+    uint64_t h = filterHash(value);
+    uint64_t step = (h >> 32) | 1;
+
+    for (int i = 0; i < FILTER_HASHES; i++) {
+        uint64_t bit = (h + i * step) & (FILTER_BITS - 1);
+        if (!(atomic_load(&f->bits[bit / 64]) & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Refill the inactive filter from the unmarked nodes and make it the active
+ * one, dropping bits left behind by deleted values. Returns false if no
+ * filter is attached or another rebuild is already running.
+ */
+bool rebuildFilter(PMEMobjpool *pop, TOID(struct list_root) root) {
+    if (!filterAttached(root)) {
+        return false;
+    }
+    struct list_state *state = listState(root);
+    if (pthread_mutex_trylock(&state->filter_rebuild_lock) != 0) {
+        return false;
+    }
+
+    struct list_filters *filter = D_RW(D_RO(root)->filter);
+    uint64_t gen = atomic_load(&filter->gen);
+    struct list_filter *shadow = &filter->sets[(gen + 1) & 1];
+    pmemobj_memset_persist(pop, shadow->bits, 0, sizeof(shadow->bits));
+
+    pthread_rwlock_wrlock(&state->filter_lock);
+    atomic_store(&filter->rebuilding, 1);
+    pmemobj_persist(pop, &filter->rebuilding, sizeof(filter->rebuilding));
+    pthread_rwlock_unlock(&state->filter_lock);
+
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) curr = D_RO(root)->head;
+    while (!TOID_IS_NULL(curr)) {
+        if (!isMarked(curr)) {
+            filterSetBits(NULL, shadow, D_RO(curr)->value);
+        }
+        curr = getNextPtr(curr);
+    }
+    exitEpoch(rec);
+    pmemobj_persist(pop, shadow->bits, sizeof(shadow->bits));
+
+    pthread_rwlock_wrlock(&state->filter_lock);
+    atomic_store(&filter->gen, gen + 1);
+    pmemobj_persist(pop, &filter->gen, sizeof(filter->gen));
+    atomic_store(&filter->rebuilding, 0);
+    pmemobj_persist(pop, &filter->rebuilding, sizeof(filter->rebuilding));
+    pthread_rwlock_unlock(&state->filter_lock);
+
+    pthread_mutex_unlock(&state->filter_rebuild_lock);
+    return true;
+}
+
+/*
+ * Allocate the filter pair for the list and build it. Like replayOpLog this
+ * must run before any writers use the list.
+ */
+void attachFilter(PMEMobjpool *pop, TOID(struct list_root) root) {
+    if (filterAttached(root)) {
+        return;
+    }
+
+    TX_BEGIN(pop) {
+        TX_SET(root, filter, TX_ZNEW(struct list_filters));
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Transaction aborted when attaching filter\n");
+        abort();
+    }
+    TX_END
+
+    rebuildFilter(pop, root);
 }
 
-TOID(struct list_node) createPersistentNode(PMEMobjpool *pop, int value) {
-    TOID(struct list_node) node;
+/*
+ * A crash during a rebuild can leave the rebuilding flag set. The active filter
+ * is always complete, so recovery only has to clear the flag.
+ */
+void recoverFilter(PMEMobjpool *pop, TOID(struct list_root) root) {
+    if (!filterAttached(root)) {
+        return;
+    }
+    struct list_filters *filter = D_RW(D_RO(root)->filter);
+    if (atomic_load(&filter->rebuilding)) {
+        atomic_store(&filter->rebuilding, 0);
+        pmemobj_persist(pop, &filter->rebuilding, sizeof(filter->rebuilding));
+    }
+}
+
+/*
+ * Help a concurrent delete by unlinking the marked node curr from prev in one
+ * transaction and retiring it. Returns prev's new successor, or curr if prev
+ * no longer points to it. A marked head is left to removeMarkedNodes, since
+ * root->head is not updated with a CAS.
+ */
+static TOID(struct list_node) unlinkMarkedNode(PMEMobjpool *pop,
+                                               TOID(struct list_root) root,
+                                               TOID(struct list_node) prev,
+                                               TOID(struct list_node) curr) {
+    TOID(struct list_node) next = getNextPtr(curr);
+    bool unlinked = false;
+
+    // a lost race ends the transaction without changes instead of aborting
+    // it, as the abort would roll prev->next back over the winner's update
+    TX_BEGIN(pop) {
+        TX_ADD_FIELD(prev, next);
+        TOID(struct list_node) expected = curr;
+        if (atomic_compare_exchange_strong(&D_RW(prev)->next, &expected,
+                                           next)) {
+            detachNodeInTx(curr);
+            unlinked = true;
+        }
+    }
+    TX_ONABORT { unlinked = false; }
+    TX_END
+
+    if (!unlinked) {
+        return curr;
+    }
+    retireNode(curr);
+    countNodes(root, 0, -1);
+    return next;
+}
+
+/*
+ * Unlink the head if it is marked. root->head is not swung with a CAS, so
+ * this takes head_lock. Returns true if this call unlinked and retired it.
+ */
+static bool unlinkMarkedHead(PMEMobjpool *pop, TOID(struct list_root) root) {
+    struct list_state *state = listState(root);
+    bool unlinked = false;
+
+    pthread_mutex_lock(&state->head_lock);
+    TOID(struct list_node) head = D_RO(root)->head;
+    if (!TOID_IS_NULL(head) && isMarked(head)) {
+        TX_BEGIN(pop) {
+            TX_ADD_FIELD(root, head);
+            D_RW(root)->head = getNextPtr(head);
+            detachNodeInTx(head);
+            unlinked = true;
+        }
+        TX_ONABORT { unlinked = false; }
+        TX_END
+    }
+    pthread_mutex_unlock(&state->head_lock);
+
+    if (unlinked) {
+        retireNode(head);
+        countNodes(root, 0, -1);
+    }
+    return unlinked;
+}
+
+static void linkPersistentNode(PMEMobjpool *pop, TOID(struct list_root) root,
+                               TOID(struct list_node) newNode) {
+    TOID(struct list_node) prev, curr;
+
+    while (true) {
+        prev = D_RW(root)->head;
+        if (TOID_IS_NULL(prev)) {
+            struct list_state *state = listState(root);
+            bool linked = false;
+
+            pthread_mutex_lock(&state->head_lock);
+            TX_BEGIN(pop) {
+                if (TOID_IS_NULL(D_RO(root)->head)) {
+                    TX_ADD_FIELD(root, head);
+                    D_RW(root)->head = newNode;
+                    linked = true;
+                }
+            }
+            TX_END
+            pthread_mutex_unlock(&state->head_lock);
+            if (linked) {
+                return;
+            }
+            continue;
+        }
+        if (isMarked(prev)) {
+            // nothing can be appended after a marked head
+            unlinkMarkedHead(pop, root);
+            continue;
+        }
+
+        curr = getNextPtr(prev);
+        while (!TOID_IS_NULL(curr)) {
+            if (isMarked(prev)) {
+                break;
+            }
+            if (isMarked(curr)) {
+                TOID(struct list_node) succ =
+                    unlinkMarkedNode(pop, root, prev, curr);
+                if (!TOID_EQUALS(succ, curr)) {
+                    curr = succ;
+                    continue;
+                }
+            }
+            prev = curr;
+            curr = getNextPtr(curr);
+        }
+
+        if (isMarked(prev)) {
+            continue;
+        }
+
+        bool linked = false;
+        TX_BEGIN(pop) {
+            TX_ADD_FIELD(prev, next);
+            TOID(struct list_node) expected = curr;
+            linked = atomic_compare_exchange_strong(&D_RW(prev)->next,
+                                                    &expected, newNode);
+        }
+        TX_ONABORT { linked = false; }
+        TX_END
+        if (linked) {
+            return;
+        }
+    }
+}
+
+void insertValue(PMEMobjpool *pop, TOID(struct list_root) root, int value) {
+    TOID(struct list_node) newNode = createPersistentNode(pop, value);
+    bool filtered = filterAttached(root);
+    struct list_state *state = NULL;
+
+    if (filtered) {
+        state = listState(root);
+        pthread_rwlock_rdlock(&state->filter_lock);
+        filterAddValue(pop, root, value);
+    }
+    struct epoch_record *rec = enterEpoch();
+    linkPersistentNode(pop, root, newNode);
+    exitEpoch(rec);
+    countNodes(root, 1, 0);
+    if (filtered) {
+        pthread_rwlock_unlock(&state->filter_lock);
+    }
+}
+
+static TOID(struct list_node) searchNode(TOID(struct list_root) root,
+                                         int value) {
+    PMEMobjpool *pop = pmemobj_pool_by_oid(root.oid);
+    TOID(struct list_node) prev = TOID_NULL(struct list_node);
+    TOID(struct list_node) current = D_RO(root)->head;
+
+    while (!TOID_IS_NULL(current)) {
+        if (isMarked(current)) {
+            if (!TOID_IS_NULL(prev)) {
+                TOID(struct list_node) succ =
+                    unlinkMarkedNode(pop, root, prev, current);
+                if (!TOID_EQUALS(succ, current)) {
+                    current = succ;
+                    continue;
+                }
+            }
+        } else if (D_RO(current)->value == value) {
+            return current;
+        }
+        prev = current;
+        current = getNextPtr(current);
+    }
+
+    return TOID_NULL(struct list_node);
+}
+
+// the node returned stays valid until it is deleted by another thread
+TOID(struct list_node) findNode(TOID(struct list_root) root, int value) {
+    if (!filterMayContain(root, value)) {
+        return TOID_NULL(struct list_node);
+    }
+
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) res = searchNode(root, value);
+    exitEpoch(rec);
+    return res;
+}
+
+struct lookup_key {
+    int key;
+    size_t index;
+};
+
+static int compareLookupKeys(const void *a, const void *b) {
+    int ka = ((const struct lookup_key *)a)->key;
+    int kb = ((const struct lookup_key *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+/*
+ * Resolve n lookups in one shared walk of the list instead of n walks. The
+ * keys are sorted once so each node is read from pmem only one time and
+ * matched with a binary search. The lookups are not interleaved with each
+ * other; the only overlap is the prefetch of the successor while the current
+ * node is matched. Marked nodes met on the way are unlinked as in findNode,
+ * and keys rejected by the filter are dropped before the walk.
+ * results[i] is the first unmarked node holding keys[i], or TOID_NULL.
+ */
+void findNodes(TOID(struct list_root) root, const int *keys, size_t n,
+               TOID(struct list_node) *results) {
+    for (size_t i = 0; i < n; i++) {
+        results[i] = TOID_NULL(struct list_node);
+    }
+    if (n == 0) {
+        return;
+    }
+
+    struct lookup_key *sorted = malloc(n * sizeof(*sorted));
+    if (sorted == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            results[i] = findNode(root, keys[i]);
+        }
+        return;
+    }
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (filterMayContain(root, keys[i])) {
+            sorted[m].key = keys[i];
+            sorted[m].index = i;
+            m++;
+        }
+    }
+    qsort(sorted, m, sizeof(*sorted), compareLookupKeys);
+
+    PMEMobjpool *pop = pmemobj_pool_by_oid(root.oid);
+    size_t remaining = m;
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) prev = TOID_NULL(struct list_node);
+    TOID(struct list_node) curr = D_RO(root)->head;
+
+    while (!TOID_IS_NULL(curr) && remaining > 0) {
+        TOID(struct list_node) next = getNextPtr(curr);
+        if (!TOID_IS_NULL(next)) {
+            __builtin_prefetch(D_RO(next));
+        }
+
+        if (isMarked(curr)) {
+            if (!TOID_IS_NULL(prev)) {
+                TOID(struct list_node) succ =
+                    unlinkMarkedNode(pop, root, prev, curr);
+                if (!TOID_EQUALS(succ, curr)) {
+                    curr = succ;
+                    continue;
+                }
+            }
+        } else {
+            int value = D_RO(curr)->value;
+            size_t lo = 0, hi = m;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (sorted[mid].key < value) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            for (; lo < m && sorted[lo].key == value; lo++) {
+                if (TOID_IS_NULL(results[sorted[lo].index])) {
+                    results[sorted[lo].index] = curr;
+                    remaining--;
+                }
+            }
+        }
+        prev = curr;
+        curr = next;
+    }
+    exitEpoch(rec);
+
+    free(sorted);
+}
+
+static bool markValue(PMEMobjpool *pop, TOID(struct list_root) root,
+                      int value) {
+    TOID(struct list_node) prev, curr, next;
+
+    while (true) {
+        prev = TOID_NULL(struct list_node);
+        curr = D_RO(root)->head;
+
+        while (!TOID_IS_NULL(curr)) {
+            if (isMarked(curr)) {
+                if (!TOID_IS_NULL(prev)) {
+                    TOID(struct list_node) succ =
+                        unlinkMarkedNode(pop, root, prev, curr);
+                    if (!TOID_EQUALS(succ, curr)) {
+                        curr = succ;
+                        continue;
+                    }
+                }
+            } else if (D_RO(curr)->value == value) {
+                break;
+            }
+            prev = curr;
+            curr = getNextPtr(curr);
+        }
+
+        if (TOID_IS_NULL(curr)) {
+            return false; // Value not found
+        }
+
+        next = getNextPtr(curr);
+
+        // Mark the node for deletion
+        bool marked = false;
+        TX_BEGIN(pop) {
+            TX_ADD_FIELD(curr, next);
+            TOID(struct list_node) expected = next;
+            marked = atomic_compare_exchange_strong(
+                &D_RW(curr)->next, &expected, getMarkedPtr(next));
+        }
+        TX_ONABORT { marked = false; }
+        TX_END
+        if (marked) {
+            countNodes(root, -1, 1);
+            return true;
+        }
+    }
+}
+
+bool markNodeForDeletion(PMEMobjpool *pop, TOID(struct list_root) root,
+                         int value) {
+    if (!filterMayContain(root, value)) {
+        return false; // Value not found
+    }
+
+    struct list_state *state = listState(root);
+    pthread_rwlock_rdlock(&state->delete_lock);
+    struct epoch_record *rec = enterEpoch();
+    bool marked = markValue(pop, root, value);
+    exitEpoch(rec);
+    pthread_rwlock_unlock(&state->delete_lock);
+    return marked;
+}
+
+/*
+ * Mark every live node whose value satisfies pred and unlink it in the same
+ * walk. Each mark and each unlink commits in its own small transaction, as
+ * in markValue and unlinkMarkedNode: a transaction held open across CASes on
+ * shared next fields would roll other threads' committed updates back if it
+ * were interrupted. A marked head is left to removeMarkedNodes. Returns the
+ * number of nodes marked.
+ */
+int deleteIf(PMEMobjpool *pop, TOID(struct list_root) root,
+             bool (*pred)(int value, void *arg), void *arg) {
+    int deleted = 0;
+    struct list_state *state = listState(root);
+    pthread_rwlock_rdlock(&state->delete_lock);
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) prev = TOID_NULL(struct list_node);
+    TOID(struct list_node) curr = D_RO(root)->head;
+
+    while (!TOID_IS_NULL(curr)) {
+        TOID(struct list_node) next = getNextPtr(curr);
+
+        if (!isMarked(curr) && pred(D_RO(curr)->value, arg)) {
+            bool marked = false;
+            TX_BEGIN(pop) {
+                TX_ADD_FIELD(curr, next);
+                TOID(struct list_node) expected = next;
+                marked = atomic_compare_exchange_strong(
+                    &D_RW(curr)->next, &expected, getMarkedPtr(next));
+            }
+            TX_ONABORT {
+                fprintf(stderr, "Transaction aborted during bulk delete\n");
+                abort();
+            }
+            TX_END
+            if (!marked) {
+                continue;
+            }
+            deleted++;
+        }
+
+        if (isMarked(curr) && !TOID_IS_NULL(prev)) {
+            TOID(struct list_node) succ =
+                unlinkMarkedNode(pop, root, prev, curr);
+            if (!TOID_EQUALS(succ, curr)) {
+                curr = succ;
+                continue;
+            }
+        }
+        prev = curr;
+        curr = getNextPtr(curr);
+    }
+    exitEpoch(rec);
+    pthread_rwlock_unlock(&state->delete_lock);
+
+    countNodes(root, -deleted, deleted);
+
+    if (deleted > 0) {
+        rebuildFilter(pop, root);
+    }
+
+    return deleted;
+}
+
+struct value_range {
+    int lo;
+    int hi;
+};
+
+static bool inRange(int value, void *arg) {
+    const struct value_range *range = arg;
+    return value >= range->lo && value <= range->hi;
+}
+
+// Delete every value in [lo, hi]
+int deleteRange(PMEMobjpool *pop, TOID(struct list_root) root, int lo,
+                int hi) {
+    struct value_range range = {lo, hi};
+    return deleteIf(pop, root, inRange, &range);
+}
+
+int removeMarkedNodes(PMEMobjpool *pop, TOID(struct list_root) root) {
+    int removed_count = 0, removed_heads = 0;
+    TOID(struct list_node) prev, curr, next;
+    struct epoch_record *rec = enterEpoch();
+
+    while (true) {
+        bool retry = false;
+        prev = D_RO(root)->head;
+
+        // Handle special case of head node marked for deletion
+        if (!TOID_IS_NULL(prev) && isMarked(prev)) {
+            if (unlinkMarkedHead(pop, root)) {
+                removed_heads++;
+            }
+            continue;
+        }
+
+        if (TOID_IS_NULL(prev)) {
+            break; // Empty list
+        }
+
+        curr = getNextPtr(prev);
+        while (!TOID_IS_NULL(curr)) {
+            next = getNextPtr(curr);
+
+            if (isMarked(curr)) {
+                // as in unlinkMarkedNode, a lost race commits empty
+                TX_BEGIN(pop) {
+                    TX_ADD_FIELD(prev, next);
+                    TOID(struct list_node) expected = curr;
+                    if (atomic_compare_exchange_strong(&D_RW(prev)->next,
+                                                       &expected, next)) {
+                        detachNodeInTx(curr);
+                    } else {
+                        retry = true;
+                    }
+                }
+                TX_ONABORT { retry = true; }
+                TX_END
+
+                if (retry) {
+                    break;
+                }
+                retireNode(curr);
+                removed_count++;
+                curr = next;
+            } else {
+                prev = curr;
+                curr = next;
+            }
+        }
+
+        if (!retry) {
+            break;
+        }
+    }
+    exitEpoch(rec);
+
+    if (removed_count > 0) {
+        countNodes(root, 0, -removed_count);
+    }
+    if (removed_count + removed_heads > 0) {
+        rebuildFilter(pop, root);
+    }
+
+    return removed_count + removed_heads;
+}
+
+void traverseList(TOID(struct list_root) root) {
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) curr = D_RO(root)->head;
+
+    if (TOID_IS_NULL(curr)) {
+        exitEpoch(rec);
+        printf("Empty list\n");
+        return;
+    }
+
+    while (!TOID_IS_NULL(curr)) {
+        if (!isMarked(curr)) {
+            printf("{%d}", D_RO(curr)->value);
+            TOID(struct list_node) next = getNextPtr(curr);
+            if (!TOID_IS_NULL(next) && !isMarked(next)) {
+                printf("->");
+            }
+        }
+        curr = getNextPtr(curr);
+    }
+    exitEpoch(rec);
+    printf("\n");
+}
+
+static bool anyValue(int value, void *arg) { return true; }
+
+/*
+ * Delete every node. The nodes are marked and unlinked like any other
+ * delete, one small transaction each, and retired through the epochs, so
+ * threads still walking the list never see a freed node. Inserts that run
+ * concurrently may or may not survive.
+ */
+void cleanupList(PMEMobjpool *pop, TOID(struct list_root) root) {
+    deleteIf(pop, root, anyValue, NULL);
+    removeMarkedNodes(pop, root);
+}
+
+/*
+ * Find the last node from inside an open transaction, starting at start or,
+ * if that is null or marked, at the head. Marked nodes met on the way (a
+ * marked head included, as in removeMarkedNodes) are unlinked as part of the
+ * transaction, so the tail returned is live and can be appended to; they are
+ * added to unlinked, to be retired once the transaction commits. The caller
+ * holds the list's head_lock for the whole transaction. Returns TOID_NULL for
+ * an empty list.
+ *
+ * The unlinks are published with a CAS before the transaction commits, so a
+ * lost race must never abort it: the abort would roll the shared next fields
+ * back over the winner's update. The walk rereads prev's successor instead,
+ * and starts over from the head if prev itself was marked.
+ */
+static TOID(struct list_node) walkToTailInTx(TOID(struct list_root) root,
+                                             TOID(struct list_node) start,
+                                             struct node_batch *unlinked) {
+    TOID(struct list_node) prev = start;
+
+    while (true) {
+        if (TOID_IS_NULL(prev) || isMarked(prev)) {
+            prev = D_RO(root)->head;
+            while (!TOID_IS_NULL(prev) && isMarked(prev)) {
+                TX_ADD_FIELD(root, head);
+                D_RW(root)->head = getNextPtr(prev);
+                detachNodeInTx(prev);
+                appendNode(unlinked, prev);
+                prev = D_RO(root)->head;
+            }
+            if (TOID_IS_NULL(prev)) {
+                return prev;
+            }
+        }
+
+        TOID(struct list_node) curr = getNextPtr(prev);
+        while (!TOID_IS_NULL(curr) && !isMarked(prev)) {
+            TOID(struct list_node) next = getNextPtr(curr);
+            if (isMarked(curr)) {
+                TX_ADD_FIELD(prev, next);
+                TOID(struct list_node) expected = curr;
+                if (!atomic_compare_exchange_strong(&D_RW(prev)->next,
+                                                    &expected, next)) {
+                    curr = getNextPtr(prev);
+                    continue;
+                }
+                detachNodeInTx(curr);
+                appendNode(unlinked, curr);
+            } else {
+                prev = curr;
+            }
+            curr = next;
+        }
+
+        if (!isMarked(prev)) {
+            return prev;
+        }
+    }
+}
+
+/*
+ * Link a privately built chain first..last after the tail from inside an open
+ * transaction, with a single CAS on the tail's next field. The chain's nodes
+ * are not reachable before that CAS, so a lost race only repeats the walk
+ * (from start, a tail hint that may be null) and never has to abort. The
+ * caller holds head_lock, which covers the empty-list case.
+ */
+static void linkChainInTx(TOID(struct list_root) root,
+                          TOID(struct list_node) first,
+                          TOID(struct list_node) start,
+                          struct node_batch *unlinked) {
+    TOID(struct list_node) tail = start;
+
+    while (true) {
+        tail = walkToTailInTx(root, tail, unlinked);
+        if (TOID_IS_NULL(tail)) {
+            TX_ADD_FIELD(root, head);
+            D_RW(root)->head = first;
+            return;
+        }
+        TX_ADD_FIELD(tail, next);
+        TOID(struct list_node) expected = TOID_NULL(struct list_node);
+        if (atomic_compare_exchange_strong(&D_RW(tail)->next, &expected,
+                                           first)) {
+            return;
+        }
+    }
+}
+
+static inline uint64_t nextLogEpoch(uint64_t epoch) {
+    uint64_t next = (epoch + 1) & OPLOG_EPOCH_MASK;
+    return next == 0 ? 1 : next;
+}
+
+static inline uint64_t packLogEntry(uint64_t epoch, enum oplog_op op,
+                                    int value) {
+    return (epoch << 33) | ((uint64_t)op << 32) | (uint32_t)value;
+}
+
+static inline uint64_t logEntryEpoch(uint64_t entry) { return entry >> 33; }
+
+static inline enum oplog_op logEntryOp(uint64_t entry) {
+    return (enum oplog_op)((entry >> 32) & 0x1);
+}
+
+static inline int logEntryValue(uint64_t entry) {
+    return (int)(uint32_t)entry;
+}
+
+/*
+ * Mark the first live node holding value from inside an open transaction,
+ * looking at the list and then at the chain of nodes the transaction has
+ * staged but not linked yet. A lost race on a shared node rescans instead
+ * of aborting, since the CAS may already have been observed by other
+ * threads. Returns false if no live node holds value.
+ */
+static bool markLoggedValueInTx(TOID(struct list_root) root,
+                                TOID(struct list_node) staged, int value) {
+    while (true) {
+        TOID(struct list_node) curr = D_RO(root)->head;
+        while (!TOID_IS_NULL(curr) &&
+               (D_RO(curr)->value != value || isMarked(curr))) {
+            curr = getNextPtr(curr);
+        }
+        if (TOID_IS_NULL(curr)) {
+            break;
+        }
+
+        TOID(struct list_node) next = getNextPtr(curr);
+        TX_ADD_FIELD(curr, next);
+        TOID(struct list_node) expected = next;
+        if (atomic_compare_exchange_strong(&D_RW(curr)->next, &expected,
+                                           getMarkedPtr(next))) {
+            return true;
+        }
+    }
+
+    // staged nodes were allocated by this transaction, so plain stores do
+    for (TOID(struct list_node) curr = staged; !TOID_IS_NULL(curr);
+         curr = getNextPtr(curr)) {
+        if (D_RO(curr)->value == value && !isMarked(curr)) {
+            atomic_store(&D_RW(curr)->next,
+                         getMarkedPtr(getNextPtr(curr)));
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Apply n logged operations to the list in one transaction that also retires
+ * the log. Inserted nodes are staged in a private chain that is linked after
+ * the tail with one final CAS, and deletes mark the list or the staged chain
+ * in log order. No step aborts on a lost race, so nothing published by the
+ * transaction is ever rolled back over another thread's update.
+ * results[i] receives the outcome of each delete.
+ */
+static void applyLogEntries(PMEMobjpool *pop, TOID(struct list_root) root,
+                            const uint64_t *entries, size_t n,
+                            bool *results) {
+    bool filtered = filterAttached(root);
+    bool deletes = false;
+    struct list_state *state = listState(root);
+    struct node_batch unlinked = {NULL, 0, 0, 0};
+
+    // only batches that delete wait for an export; inserts never do
+    for (size_t i = 0; i < n && !deletes; i++) {
+        deletes = logEntryOp(entries[i]) == OPLOG_DELETE;
+    }
+    if (deletes) {
+        pthread_rwlock_rdlock(&state->delete_lock);
+    }
+    if (filtered) {
+        pthread_rwlock_rdlock(&state->filter_lock);
+        for (size_t i = 0; i < n; i++) {
+            if (logEntryOp(entries[i]) == OPLOG_INSERT) {
+                filterAddValue(pop, root, logEntryValue(entries[i]));
+            }
+        }
+    }
+
+    struct epoch_record *rec = enterEpoch();
+    pthread_mutex_lock(&state->head_lock);
+    TX_BEGIN(pop) {
+        TOID(struct list_node) first = TOID_NULL(struct list_node);
+        TOID(struct list_node) last = TOID_NULL(struct list_node);
+
+        for (size_t i = 0; i < n; i++) {
+            int value = logEntryValue(entries[i]);
+
+            if (logEntryOp(entries[i]) == OPLOG_INSERT) {
+                TOID(struct list_node) node = TX_NEW(struct list_node);
+                D_RW(node)->value = value;
+                atomic_store(&D_RW(node)->next, TOID_NULL(struct list_node));
+                if (TOID_IS_NULL(first)) {
+                    first = node;
+                } else if (isMarked(last)) {
+                    // keep the mark of a staged node deleted earlier on
+                    atomic_store(&D_RW(last)->next, getMarkedPtr(node));
+                } else {
+                    atomic_store(&D_RW(last)->next, node);
+                }
+                last = node;
+                results[i] = true;
+            } else {
+                results[i] = markLoggedValueInTx(root, first, value);
+            }
+        }
+
+        if (!TOID_IS_NULL(first)) {
+            linkChainInTx(root, first, TOID_NULL(struct list_node),
+                          &unlinked);
+        }
+
+        TOID(struct op_log) log = D_RO(root)->log;
+        uint64_t epoch = nextLogEpoch(D_RO(log)->epoch);
+        TX_SET(log, epoch, epoch);
+        if (epoch == OPLOG_EPOCH_MASK) {
+            // Clear entries before the epoch wraps so stale words from
+            // an old generation can never look live again.
+            TX_ADD_FIELD(log, entries);
+            memset(D_RW(log)->entries, 0, sizeof(D_RW(log)->entries));
+        }
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Transaction aborted when applying op log\n");
+        abort();
+    }
+    TX_END
+    pthread_mutex_unlock(&state->head_lock);
+    exitEpoch(rec);
+    retireNodes(&unlinked);
+    free(unlinked.nodes);
+
+    countNodes(root, 0, -(int64_t)unlinked.count);
+    for (size_t i = 0; i < n; i++) {
+        if (logEntryOp(entries[i]) == OPLOG_INSERT) {
+            countNodes(root, 1, 0);
+        } else if (results[i]) {
+            countNodes(root, -1, 1);
+        }
+    }
+
+    if (filtered) {
+        pthread_rwlock_unlock(&state->filter_lock);
+    }
+    if (deletes) {
+        pthread_rwlock_unlock(&state->delete_lock);
+    }
+}
+
+/*
+ * Re-apply a batch that was made durable in the log but whose apply
+ * transaction did not commit before a crash. Returns the number of replayed
+ * operations. Must be called after opening the pool, before any writers.
+ */
+int replayOpLog(PMEMobjpool *pop, TOID(struct list_root) root) {
+    if (TOID_IS_NULL(D_RO(root)->log)) {
+        return 0;
+    }
+    const struct op_log *log = D_RO(D_RO(root)->log);
+    uint64_t epoch = nextLogEpoch(log->epoch);
+    bool results[OPLOG_CAPACITY];
+    size_t n = 0;
+
+    while (n < OPLOG_CAPACITY && logEntryEpoch(log->entries[n]) == epoch) {
+        n++;
+    }
+    if (n > 0) {
+        applyLogEntries(pop, root, log->entries, n, results);
+    }
+
+    return (int)n;
+}
+
+// allocate the list's op log the first time a batching front end is created
+static void attachOpLog(PMEMobjpool *pop, TOID(struct list_root) root) {
+    static pthread_mutex_t attachLock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&attachLock);
+    if (TOID_IS_NULL(D_RO(root)->log)) {
+        TX_BEGIN(pop) {
+            TX_SET(root, log, TX_ZNEW(struct op_log));
+        }
+        TX_ONABORT {
+            fprintf(stderr, "Transaction aborted when attaching op log\n");
+            abort();
+        }
+        TX_END
+    }
+    pthread_mutex_unlock(&attachLock);
+}
+
+struct logged_op {
+    enum oplog_op op;
+    int value;
+};
+
+/*
+ * Persist up to OPLOG_CAPACITY operations in the list's op log with a single
+ * fence, then apply them in one transaction. Callers must serialize batches
+ * on the same list, since the log is shared.
+ */
+static void commitLoggedBatch(PMEMobjpool *pop, TOID(struct list_root) root,
+                              const struct logged_op *ops, size_t n,
+                              bool *results) {
+    struct op_log *log = D_RW(D_RO(root)->log);
+    uint64_t epoch = nextLogEpoch(log->epoch);
+
+    for (size_t i = 0; i < n; i++) {
+        log->entries[i] = packLogEntry(epoch, ops[i].op, ops[i].value);
+    }
+    pmemobj_persist(pop, log->entries, n * sizeof(log->entries[0]));
+
+    applyLogEntries(pop, root, log->entries, n, results);
+}
+
+struct group_request {
+    enum oplog_op op;
+    int value;
+    bool result;
+    bool done;
+    struct group_request *next;
+};
+
+/*
+ * Group-commit front end. Concurrent callers queue their operation; whichever
+ * thread finds no leader active takes up to OPLOG_CAPACITY queued requests,
+ * persists them to the op log with a single fence, applies them in one
+ * transaction and wakes the waiters.
+ */
+struct group_commit {
+    PMEMobjpool *pop;
+    TOID(struct list_root) root;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct group_request *pending;
+    struct group_request **pending_tail;
+    bool leader_active;
+};
+
+struct group_commit *groupCommitCreate(PMEMobjpool *pop,
+                                       TOID(struct list_root) root) {
+    struct group_commit *gc = malloc(sizeof(*gc));
+    if (gc == NULL) {
+        perror("Failed to allocate group commit state");
+        exit(EXIT_FAILURE);
+    }
+    attachOpLog(pop, root);
+    gc->pop = pop;
+    gc->root = root;
+    pthread_mutex_init(&gc->lock, NULL);
+    pthread_cond_init(&gc->done, NULL);
+    gc->pending = NULL;
+    gc->pending_tail = &gc->pending;
+    gc->leader_active = false;
+    return gc;
+}
+
+void groupCommitDestroy(struct group_commit *gc) {
+    pthread_cond_destroy(&gc->done);
+    pthread_mutex_destroy(&gc->lock);
+    free(gc);
+}
+
+static void groupCommitLead(struct group_commit *gc,
+                            struct group_request **batch, size_t n) {
+    struct logged_op ops[OPLOG_CAPACITY];
+    bool results[OPLOG_CAPACITY];
+
+    for (size_t i = 0; i < n; i++) {
+        ops[i].op = batch[i]->op;
+        ops[i].value = batch[i]->value;
+    }
+
+    commitLoggedBatch(gc->pop, gc->root, ops, n, results);
+
+    for (size_t i = 0; i < n; i++) {
+        batch[i]->result = results[i];
+    }
+}
+
+static bool groupCommitSubmit(struct group_commit *gc, enum oplog_op op,
+                              int value) {
+    struct group_request req = {op, value, false, false, NULL};
+    struct group_request *batch[OPLOG_CAPACITY];
+
+    pthread_mutex_lock(&gc->lock);
+    *gc->pending_tail = &req;
+    gc->pending_tail = &req.next;
+
+    while (!req.done) {
+        if (gc->leader_active) {
+            pthread_cond_wait(&gc->done, &gc->lock);
+            continue;
+        }
+
+        gc->leader_active = true;
+        size_t n = 0;
+        while (gc->pending != NULL && n < OPLOG_CAPACITY) {
+            batch[n++] = gc->pending;
+            gc->pending = gc->pending->next;
+        }
+        if (gc->pending == NULL) {
+            gc->pending_tail = &gc->pending;
+        }
+        pthread_mutex_unlock(&gc->lock);
+
+        groupCommitLead(gc, batch, n);
+
+        pthread_mutex_lock(&gc->lock);
+        for (size_t i = 0; i < n; i++) {
+            batch[i]->done = true;
+        }
+        gc->leader_active = false;
+        pthread_cond_broadcast(&gc->done);
+    }
+    pthread_mutex_unlock(&gc->lock);
+
+    return req.result;
+}
+
+void groupInsertValue(struct group_commit *gc, int value) {
+    groupCommitSubmit(gc, OPLOG_INSERT, value);
+}
+
+bool groupMarkNodeForDeletion(struct group_commit *gc, int value) {
+    return groupCommitSubmit(gc, OPLOG_DELETE, value);
+}
+
+/*
+ * Tiered front end: a DRAM cache of per-value entries, chained in hash
+ * buckets like the regular_ll Node list, in front of the persistent list.
+ * Writes update the cache and are queued; a writer thread drains the queue
+ * through the op log in batches. At most max_dirty operations can be queued
+ * or in flight, which bounds what a crash can lose, and tieredFlush waits
+ * until everything queued so far is durable. The tiered list must be the
+ * only writer of the persistent list and owns its op log (no group_commit
+ * on the same list).
+ *
+ * An entry caches how many live copies of its value the list holds rather
+ * than copies of the nodes themselves. The list is unordered and keeps
+ * duplicates, so a find or delete only ever needs that count; a cached node
+ * would either pin a pmem node against reclamation or duplicate its value
+ * without adding anything a count does not answer.
+ */
+#define TIER_BUCKETS 4096
+#define TIER_STRIPES 64
+#define TIER_MAX_ENTRIES 16384
+
+struct tier_entry {
+    int value;
+    bool known;      // count reflects the persistent list plus pending ops
+    int64_t count;   // live copies of value, valid only if known
+    int64_t pending; // queued inserts minus queued deletes of value
+    int64_t queued;  // queued operations on value; pins the entry
+    // second-chance bit for eviction, also set by finds holding the
+    // stripe shared
+    _Atomic bool referenced;
+    struct tier_entry *next;
+};
+
+/*
+ * The buckets are guarded by TIER_STRIPES rwlocks, bucket i by stripe
+ * i % TIER_STRIPES, so a find that hits the cache only takes its stripe
+ * shared. lock guards the queue and the counters after it and is taken
+ * after a stripe, never before. An operation reserves its queue slot before
+ * it takes its stripe, so it never waits for space while holding one.
+ */
+struct tiered_list {
+    PMEMobjpool *pop;
+    TOID(struct list_root) root;
+    pthread_rwlock_t stripes[TIER_STRIPES];
+    pthread_mutex_t evict_lock; // clock_hand
+    pthread_mutex_t lock;
+    pthread_mutex_t apply_lock; // held while a batch is applied to pmem
+    _Atomic uint64_t apply_seq; // odd while a batch is being applied
+    pthread_cond_t work;
+    pthread_cond_t space;
+    pthread_cond_t drained;
+    struct tier_entry *buckets[TIER_BUCKETS];
+    atomic_size_t entries;
+    size_t clock_hand;
+    struct logged_op *queue;
+    size_t queue_head;
+    size_t queue_len;
+    size_t max_dirty;
+    size_t reserved; // slots taken by operations not yet queued
+    uint64_t enqueued;
+    uint64_t applied;
+    bool stop;
+    pthread_t writer;
+};
+
+static inline size_t tierBucket(int value) {
+    return filterHash(value) % TIER_BUCKETS;
+}
+
+static inline pthread_rwlock_t *tierStripe(struct tiered_list *t,
+                                           int value) {
+    return &t->stripes[tierBucket(value) % TIER_STRIPES];
+}
+
+static struct tier_entry *tierLookup(struct tiered_list *t, int value) {
+    struct tier_entry *e = t->buckets[tierBucket(value)];
+    while (e != NULL && e->value != value) {
+        e = e->next;
+    }
+    return e;
+}
+
+/*
+ * Drop one clean entry that has not been referenced since the last sweep.
+ * The caller holds the stripe of bucket; buckets of other stripes that are
+ * busy are skipped rather than waited for.
+ */
+static void tierEvict(struct tiered_list *t, size_t bucket) {
+    pthread_mutex_lock(&t->evict_lock);
+    for (size_t scanned = 0; scanned < 2 * TIER_BUCKETS; scanned++) {
+        size_t b = t->clock_hand;
+        t->clock_hand = (t->clock_hand + 1) % TIER_BUCKETS;
+
+        pthread_rwlock_t *stripe = &t->stripes[b % TIER_STRIPES];
+        bool own = b % TIER_STRIPES == bucket % TIER_STRIPES;
+        if (!own && pthread_rwlock_trywrlock(stripe) != 0) {
+            continue;
+        }
+
+        bool evicted = false;
+        for (struct tier_entry **link = &t->buckets[b]; *link != NULL;
+             link = &(*link)->next) {
+            struct tier_entry *e = *link;
+            if (e->queued != 0) {
+                continue;
+            }
+            if (atomic_load_explicit(&e->referenced, memory_order_relaxed)) {
+                atomic_store_explicit(&e->referenced, false,
+                                      memory_order_relaxed);
+                continue;
+            }
+            *link = e->next;
+            free(e);
+            atomic_fetch_sub(&t->entries, 1);
+            evicted = true;
+            break;
+        }
+        if (!own) {
+            pthread_rwlock_unlock(stripe);
+        }
+        if (evicted) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&t->evict_lock);
+}
+
+// the caller holds value's stripe exclusively
+static struct tier_entry *tierGetEntry(struct tiered_list *t, int value) {
+    struct tier_entry *e = tierLookup(t, value);
+    if (e != NULL) {
+        return e;
+    }
+
+    size_t bucket = tierBucket(value);
+    if (atomic_load(&t->entries) >= TIER_MAX_ENTRIES) {
+        tierEvict(t, bucket);
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (e == NULL) {
+        perror("Failed to allocate tier entry");
+        exit(EXIT_FAILURE);
+    }
+    e->value = value;
+    e->next = t->buckets[bucket];
+    t->buckets[bucket] = e;
+    atomic_fetch_add(&t->entries, 1);
+    return e;
+}
+
+#define TIER_LOAD_RETRIES 4
+
+// live copies of value in the persistent list; a filter, if the list has
+// one, answers for absent values without a walk
+static int64_t tierCountPersisted(struct tiered_list *t, int value) {
+    int64_t persisted = 0;
+
+    if (!filterMayContain(t->root, value)) {
+        return 0;
+    }
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) curr = D_RO(t->root)->head;
+    while (!TOID_IS_NULL(curr)) {
+        if (!isMarked(curr) && D_RO(curr)->value == value) {
+            persisted++;
+        }
+        curr = getNextPtr(curr);
+    }
+    exitEpoch(rec);
+    return persisted;
+}
+
+/*
+ * Count the live copies of value in the persistent list and cache the result.
+ * The count is only exact together with value's pending operations as of
+ * the same batch boundary. The walk runs without apply_lock, so a miss does
+ * not stall the writer, and is kept if apply_seq was the same even number
+ * before it and after it, checked under the stripe: then no batch was
+ * applied in between. After TIER_LOAD_RETRIES lost races the walk runs
+ * under apply_lock, which keeps the writer out.
+ */
+static void tierLoad(struct tiered_list *t, int value) {
+    pthread_rwlock_t *stripe = tierStripe(t, value);
+
+    for (int attempt = 0;; attempt++) {
+        bool locked = attempt >= TIER_LOAD_RETRIES;
+        if (locked) {
+            pthread_mutex_lock(&t->apply_lock);
+        }
+        uint64_t seq = atomic_load(&t->apply_seq);
+        int64_t persisted = seq & 1 ? 0 : tierCountPersisted(t, value);
+
+        pthread_rwlock_wrlock(stripe);
+        bool stable = !(seq & 1) && atomic_load(&t->apply_seq) == seq;
+        if (stable) {
+            struct tier_entry *e = tierGetEntry(t, value);
+            e->count = persisted + e->pending;
+            e->known = true;
+            atomic_store_explicit(&e->referenced, true,
+                                  memory_order_relaxed);
+        }
+        pthread_rwlock_unlock(stripe);
+        if (locked) {
+            pthread_mutex_unlock(&t->apply_lock);
+        }
+        if (stable) {
+            return;
+        }
+    }
+}
+
+/*
+ * Operations still queued or being applied count against max_dirty, so the
+ * bound holds until they are durable, not just until the writer takes them.
+ */
+static void tierReserve(struct tiered_list *t) {
+    pthread_mutex_lock(&t->lock);
+    while (t->enqueued - t->applied + t->reserved >= t->max_dirty) {
+        pthread_cond_wait(&t->space, &t->lock);
+    }
+    t->reserved++;
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void tierCancel(struct tiered_list *t) {
+    pthread_mutex_lock(&t->lock);
+    t->reserved--;
+    pthread_cond_signal(&t->space);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// queue a reserved operation on e; e's stripe is held exclusively
+static void tierEnqueue(struct tiered_list *t, struct tier_entry *e,
+                        enum oplog_op op) {
+    e->queued++;
+
+    pthread_mutex_lock(&t->lock);
+    size_t slot = (t->queue_head + t->queue_len) % t->max_dirty;
+    t->queue[slot].op = op;
+    t->queue[slot].value = e->value;
+    t->queue_len++;
+    t->reserved--;
+    t->enqueued++;
+    pthread_cond_signal(&t->work);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void *tierWriter(void *arg) {
+    struct tiered_list *t = arg;
+    struct logged_op batch[OPLOG_CAPACITY];
+    bool results[OPLOG_CAPACITY];
+
+    pthread_mutex_lock(&t->lock);
+    while (true) {
+        while (t->queue_len == 0 && !t->stop) {
+            pthread_cond_wait(&t->work, &t->lock);
+        }
+        if (t->queue_len == 0) {
+            break;
+        }
+
+        size_t n = 0;
+        while (t->queue_len > 0 && n < OPLOG_CAPACITY) {
+            batch[n++] = t->queue[t->queue_head];
+            t->queue_head = (t->queue_head + 1) % t->max_dirty;
+            t->queue_len--;
+        }
+        pthread_mutex_unlock(&t->lock);
+
+        pthread_mutex_lock(&t->apply_lock);
+        atomic_fetch_add(&t->apply_seq, 1);
+        commitLoggedBatch(t->pop, t->root, batch, n, results);
+
+        for (size_t i = 0; i < n; i++) {
+            pthread_rwlock_t *stripe = tierStripe(t, batch[i].value);
+            pthread_rwlock_wrlock(stripe);
+            struct tier_entry *e = tierLookup(t, batch[i].value);
+            e->pending -= batch[i].op == OPLOG_INSERT ? 1 : -1;
+            e->queued--;
+            pthread_rwlock_unlock(stripe);
+        }
+        atomic_fetch_add(&t->apply_seq, 1);
+        pthread_mutex_unlock(&t->apply_lock);
+
+        pthread_mutex_lock(&t->lock);
+        t->applied += n;
+        pthread_cond_broadcast(&t->space);
+        pthread_cond_broadcast(&t->drained);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+struct tiered_list *tieredCreate(PMEMobjpool *pop, TOID(struct list_root) root,
+                                 size_t max_dirty) {
+    struct tiered_list *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        perror("Failed to allocate tiered list");
+        exit(EXIT_FAILURE);
+    }
+    attachOpLog(pop, root);
+    t->pop = pop;
+    t->root = root;
+    t->max_dirty = max_dirty > 0 ? max_dirty : 1;
+    t->queue = malloc(t->max_dirty * sizeof(*t->queue));
+    if (t->queue == NULL) {
+        perror("Failed to allocate tiered write-back queue");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < TIER_STRIPES; i++) {
+        pthread_rwlock_init(&t->stripes[i], NULL);
+    }
+    pthread_mutex_init(&t->evict_lock, NULL);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_mutex_init(&t->apply_lock, NULL);
+    pthread_cond_init(&t->work, NULL);
+    pthread_cond_init(&t->space, NULL);
+    pthread_cond_init(&t->drained, NULL);
+
+    if (pthread_create(&t->writer, NULL, tierWriter, t) != 0) {
+        perror("Failed to start tiered write-back thread");
+        exit(EXIT_FAILURE);
+    }
+    return t;
+}
+
+void tieredInsert(struct tiered_list *t, int value) {
+    tierReserve(t);
+
+    pthread_rwlock_t *stripe = tierStripe(t, value);
+    pthread_rwlock_wrlock(stripe);
+    struct tier_entry *e = tierGetEntry(t, value);
+    e->pending++;
+    if (e->known) {
+        e->count++;
+    }
+    atomic_store_explicit(&e->referenced, true, memory_order_relaxed);
+    tierEnqueue(t, e, OPLOG_INSERT);
+    pthread_rwlock_unlock(stripe);
+}
+
+bool tieredFind(struct tiered_list *t, int value) {
+    pthread_rwlock_t *stripe = tierStripe(t, value);
+
+    while (true) {
+        pthread_rwlock_rdlock(stripe);
+        struct tier_entry *e = tierLookup(t, value);
+        if (e != NULL && (e->known || e->pending > 0)) {
+            bool found = e->known ? e->count > 0 : true;
+            if (!atomic_load_explicit(&e->referenced,
+                                      memory_order_relaxed)) {
+                atomic_store_explicit(&e->referenced, true,
+                                      memory_order_relaxed);
+            }
+            pthread_rwlock_unlock(stripe);
+            return found;
+        }
+        pthread_rwlock_unlock(stripe);
+
+        tierLoad(t, value);
+    }
+}
+
+bool tieredMarkNodeForDeletion(struct tiered_list *t, int value) {
+    pthread_rwlock_t *stripe = tierStripe(t, value);
+
+    while (true) {
+        tierReserve(t);
+        pthread_rwlock_wrlock(stripe);
+        struct tier_entry *e = tierLookup(t, value);
+        if (e != NULL && e->known) {
+            bool found = e->count > 0;
+            if (found) {
+                e->count--;
+                e->pending--;
+                tierEnqueue(t, e, OPLOG_DELETE);
+            } else {
+                tierCancel(t);
+            }
+            atomic_store_explicit(&e->referenced, true, memory_order_relaxed);
+            pthread_rwlock_unlock(stripe);
+            return found;
+        }
+        pthread_rwlock_unlock(stripe);
+        tierCancel(t);
+
+        tierLoad(t, value);
+    }
+}
+
+// wait until every operation queued before the call is durable in pmem
+void tieredFlush(struct tiered_list *t) {
+    pthread_mutex_lock(&t->lock);
+    uint64_t target = t->enqueued;
+    while (t->applied < target) {
+        pthread_cond_wait(&t->drained, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void tieredDestroy(struct tiered_list *t) {
+    pthread_mutex_lock(&t->lock);
+    t->stop = true;
+    pthread_cond_signal(&t->work);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+
+    for (size_t i = 0; i < TIER_BUCKETS; i++) {
+        struct tier_entry *e = t->buckets[i];
+        while (e != NULL) {
+            struct tier_entry *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    pthread_cond_destroy(&t->drained);
+    pthread_cond_destroy(&t->space);
+    pthread_cond_destroy(&t->work);
+    pthread_mutex_destroy(&t->apply_lock);
+    pthread_mutex_destroy(&t->lock);
+    pthread_mutex_destroy(&t->evict_lock);
+    for (int i = 0; i < TIER_STRIPES; i++) {
+        pthread_rwlock_destroy(&t->stripes[i]);
+    }
+    free(t->queue);
+    free(t);
+}
+
+/*
+ * Snapshot file format: a fixed header followed by `count` native-endian 32-bit
+ * values in list order. The checksum is FNV-1a over the value bytes.
+ */
+#define SNAPSHOT_MAGIC "LLPMSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_IMPORT_CHUNK 1024
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t value_size;
+    uint64_t count;
+    uint64_t checksum;
+};
+
+static uint64_t snapshotChecksum(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Stream every unmarked value into a snapshot file as of a single point in
+ * time. The walk holds delete_lock exclusively, so deletes wait for it while
+ * inserts keep running. With no node turning from live to marked, the live
+ * set only grows, and only by appends at the tail, so the values passed on
+ * the way to the tail are exactly the list at the moment its null next is
+ * read. The file is written to "<path>.tmp", synced and renamed into place,
+ * so a crash never leaves a torn snapshot behind.
+ */
+long exportSnapshot(TOID(struct list_root) root, const char *path) {
+    char tmp_path[4096];
+    struct snapshot_header header;
+    uint64_t checksum = 0xcbf29ce484222325ULL;
+    uint64_t count = 0;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+        (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+        goto err;
+    }
+
+    struct list_state *state = listState(root);
+    pthread_rwlock_wrlock(&state->delete_lock);
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) curr = D_RO(root)->head;
+    while (!TOID_IS_NULL(curr)) {
+        if (!isMarked(curr)) {
+            int32_t value = D_RO(curr)->value;
+            if (fwrite(&value, sizeof(value), 1, out) != 1) {
+                exitEpoch(rec);
+                pthread_rwlock_unlock(&state->delete_lock);
+                goto err;
+            }
+            checksum = snapshotChecksum(checksum, &value, sizeof(value));
+            count++;
+        }
+        curr = getNextPtr(curr);
+    }
+    exitEpoch(rec);
+    pthread_rwlock_unlock(&state->delete_lock);
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.value_size = sizeof(int32_t);
+    header.count = count;
+    header.checksum = checksum;
 
-    TX_BEGIN(pop) {
-        node = TX_NEW(struct list_node);
-        TX_ADD_DIRECT(&D_RW(node)->value);
-        D_RW(node)->value = value;
-        TX_ADD_DIRECT(&D_RW(node)->next);
-        TOID_ASSIGN(D_RW(node)->next, OID_NULL);
+    if (fseek(out, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, out) != 1 || fflush(out) != 0 ||
+        fsync(fileno(out)) != 0) {
+        goto err;
     }
-    TX_ONABORT {
-        fprintf(stderr, "Transaction aborted when creating node\n");
-        abort();
+    if (fclose(out) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
     }
-    TX_END
 
-    return node;
+    return (long)count;
+
+err:
+    fclose(out);
+    unlink(tmp_path);
+    return -1;
 }
 
-void insertValue(PMEMobjpool *pop, TOID(struct list_root) root, int value) {
-    TOID(struct list_node) newNode = createPersistentNode(pop, value);
-    TOID(struct list_node) prev, curr;
+/*
+ * Build a chain of n nodes and link it after the current tail in a single
+ * transaction, so either the whole chunk becomes visible or none of it does.
+ * `tail` is a hint carried between chunks to avoid rescanning from head;
+ * the caller stays in one epoch so it is not freed in between. Returns false
+ * with errno set only if the transaction aborts, e.g. when the pool is full.
+ */
+static bool appendSnapshotChunk(PMEMobjpool *pop, TOID(struct list_root) root,
+                                const int32_t *values, size_t n,
+                                TOID(struct list_node) *tail) {
+    bool linked = false;
+    bool filtered = filterAttached(root);
+    struct list_state *state = listState(root);
+    struct node_batch unlinked = {NULL, 0, 0, 0};
+    TOID(struct list_node) first, last;
 
-    while (true) {
-        prev = D_RW(root)->head;
-        if (TOID_IS_NULL(prev)) {
-            TX_BEGIN(pop) {
-                TX_ADD_FIELD(root, head);
-                if (TOID_IS_NULL(D_RO(root)->head)) {
-                    D_RW(root)->head = newNode;
-                    TX_COMMIT;
-                    return;
-                }
-            }
-            TX_END
-            continue;
+    if (filtered) {
+        pthread_rwlock_rdlock(&state->filter_lock);
+        for (size_t i = 0; i < n; i++) {
+            filterAddValue(pop, root, values[i]);
         }
+    }
 
-        curr = getNextPtr(prev);
-        while (!TOID_IS_NULL(curr)) {
-            if (isMarked(prev)) {
-                break;
+    pthread_mutex_lock(&state->head_lock);
+    TX_BEGIN(pop) {
+        first = TOID_NULL(struct list_node);
+        last = TOID_NULL(struct list_node);
+        for (size_t i = 0; i < n; i++) {
+            TOID(struct list_node) node = TX_NEW(struct list_node);
+            D_RW(node)->value = values[i];
+            atomic_store(&D_RW(node)->next, TOID_NULL(struct list_node));
+            if (TOID_IS_NULL(first)) {
+                first = node;
+            } else {
+                atomic_store(&D_RW(last)->next, node);
             }
-            prev = curr;
-            curr = getNextPtr(curr);
+            last = node;
         }
+        linkChainInTx(root, first, *tail, &unlinked);
+    }
+    TX_ONCOMMIT {
+        *tail = last;
+        linked = true;
+    }
+    TX_ONABORT { *tail = TOID_NULL(struct list_node); }
+    TX_END
+    pthread_mutex_unlock(&state->head_lock);
 
-        if (isMarked(prev)) {
-            continue;
-        }
+    if (linked) {
+        retireNodes(&unlinked);
+        countNodes(root, (int64_t)n, -(int64_t)unlinked.count);
+    }
+    free(unlinked.nodes);
 
-        TX_BEGIN(pop) {
-            TX_ADD_FIELD(prev, next);
-            TOID(struct list_node) expected = curr;
-            if (atomic_compare_exchange_strong(&D_RW(prev)->next, &expected,
-                                               newNode)) {
-                TX_COMMIT;
-                return;
-            }
-        }
-        TX_END
+    if (filtered) {
+        pthread_rwlock_unlock(&state->filter_lock);
     }
+
+    return linked;
 }
 
-TOID(struct list_node) findNode(TOID(struct list_root) root, int value) {
-    TOID(struct list_node) current = D_RO(root)->head;
+/*
+ * Map a snapshot file, validate it and append its values to the list in
+ * chunks of SNAPSHOT_IMPORT_CHUNK nodes. Returns the number of imported
+ * values, or -1 with errno set if the file is unreadable or corrupt or the
+ * pool runs out of space (chunks committed before that remain in the list).
+ */
+long importSnapshot(PMEMobjpool *pop, TOID(struct list_root) root,
+                    const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct snapshot_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
 
-    while (!TOID_IS_NULL(current)) {
-        if (D_RO(current)->value == value && !isMarked(current)) {
-            return current;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    const struct snapshot_header *header = map;
+    const int32_t *values =
+        (const int32_t *)((const char *)map + sizeof(*header));
+    size_t payload = st.st_size - sizeof(*header);
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->value_size != sizeof(int32_t) ||
+        header->count != payload / sizeof(int32_t) ||
+        payload % sizeof(int32_t) != 0 ||
+        snapshotChecksum(0xcbf29ce484222325ULL, values, payload) !=
+            header->checksum) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    // one epoch for the whole import keeps the tail hint from being freed
+    // between chunks
+    struct epoch_record *rec = enterEpoch();
+    TOID(struct list_node) tail = TOID_NULL(struct list_node);
+    uint64_t done = 0;
+    while (done < header->count) {
+        size_t n = header->count - done;
+        if (n > SNAPSHOT_IMPORT_CHUNK) {
+            n = SNAPSHOT_IMPORT_CHUNK;
         }
-        current = getNextPtr(current);
+        if (!appendSnapshotChunk(pop, root, values + done, n, &tail)) {
+            exitEpoch(rec);
+            munmap(map, st.st_size);
+            return -1;
+        }
+        done += n;
     }
+    exitEpoch(rec);
 
-    return TOID_NULL(struct list_node);
+    munmap(map, st.st_size);
+    return (long)done;
 }
 
-bool markNodeForDeletion(PMEMobjpool *pop, TOID(struct list_root) root,
-                         int value) {
-    TOID(struct list_node) curr, next;
+/*
+ * Open a list for this session: reset its filter flag, load its counts, or
+ * recount them if the last session did not write them back, and replay its
+ * op log. The stored counts stay invalid until closeLists writes them again,
+ * so a crash in between makes the next open recount. Must run before any
+ * other thread uses the list.
+ */
+static int recoverList(PMEMobjpool *pop, TOID(struct list_root) list) {
+    struct list_state *state = listState(list);
+    bool counted = D_RO(list)->counts_valid;
 
-    while (true) {
-        curr = D_RO(root)->head;
+    recoverFilter(pop, list);
+    if (counted) {
+        setCounts(state, D_RO(list)->live, D_RO(list)->marked);
+        D_RW(list)->counts_valid = 0;
+        pmemobj_persist(pop, &D_RW(list)->counts_valid,
+                        sizeof(D_RO(list)->counts_valid));
+    }
+    int replayed = replayOpLog(pop, list);
+    if (!counted) {
+        recountList(list);
+    }
+    state->opened = true;
+    return replayed;
+}
 
-        while (!TOID_IS_NULL(curr) &&
-               (D_RO(curr)->value != value || isMarked(curr))) {
-            curr = getNextPtr(curr);
-        }
+/*
+ * Directory operations are serialized by dirLock. A list returned by
+ * openNamedList stays valid until it is dropped; the first open in a session
+ * recovers it.
+ */
+static pthread_mutex_t dirLock = PTHREAD_MUTEX_INITIALIZER;
 
-        if (TOID_IS_NULL(curr)) {
-            return false; // Value not found
-        }
+static uint64_t dirBucket(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash % LIST_DIR_BUCKETS;
+}
 
-        next = getNextPtr(curr);
+static TOID(struct list_dir_entry) dirLookup(TOID(struct pool_root) pool,
+                                             const char *name) {
+    if (TOID_IS_NULL(D_RO(pool)->dir)) {
+        return TOID_NULL(struct list_dir_entry);
+    }
 
-        // Mark the node for deletion
-        TX_BEGIN(pop) {
-            TX_ADD_FIELD(curr, next);
-            TOID(struct list_node) expected = next;
-            if (atomic_compare_exchange_strong(&D_RW(curr)->next, &expected,
-                                               getMarkedPtr(next))) {
-                TX_COMMIT;
-                return true;
-            }
-        }
-        TX_END
+    TOID(struct list_dir_entry) entry =
+        D_RO(D_RO(pool)->dir)->buckets[dirBucket(name)];
+    while (!TOID_IS_NULL(entry) &&
+           strncmp(D_RO(entry)->name, name, LIST_NAME_MAX) != 0) {
+        entry = D_RO(entry)->next;
     }
+    return entry;
 }
 
-int removeMarkedNodes(PMEMobjpool *pop, TOID(struct list_root) root) {
-    int removed_count = 0;
-    TOID(struct list_node) prev, curr, next;
+TOID(struct list_root) openNamedList(PMEMobjpool *pop,
+                                     TOID(struct pool_root) pool,
+                                     const char *name) {
+    pthread_mutex_lock(&dirLock);
+    TOID(struct list_dir_entry) entry = dirLookup(pool, name);
+    TOID(struct list_root) list = TOID_IS_NULL(entry)
+                                      ? TOID_NULL(struct list_root)
+                                      : D_RO(entry)->list;
+    if (!TOID_IS_NULL(list) && !listState(list)->opened) {
+        recoverList(pop, list);
+    }
+    pthread_mutex_unlock(&dirLock);
+    return list;
+}
 
-    while (true) {
-        bool retry = false;
-        prev = D_RO(root)->head;
+/*
+ * Create an empty list called name in the pool. Returns TOID_NULL with errno
+ * set to EEXIST if the name is taken or ENAMETOOLONG if it does not fit.
+ */
+TOID(struct list_root) createNamedList(PMEMobjpool *pop,
+                                       TOID(struct pool_root) pool,
+                                       const char *name) {
+    TOID(struct list_root) list = TOID_NULL(struct list_root);
 
-        // Handle special case of head node marked for deletion
-        if (!TOID_IS_NULL(prev) && isMarked(prev)) {
-            curr = getNextPtr(prev);
-            TX_BEGIN(pop) {
-                TX_ADD_FIELD(root, head);
-                TX_FREE(prev);
-                D_RW(root)->head = curr;
-                removed_count++;
-            }
-            TX_ONABORT { retry = true; }
-            TX_END
+    if (strlen(name) >= LIST_NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return list;
+    }
 
-            if (retry) {
-                continue;
-            }
-            prev = D_RO(root)->head;
-        }
+    pthread_mutex_lock(&dirLock);
+    if (!TOID_IS_NULL(dirLookup(pool, name))) {
+        pthread_mutex_unlock(&dirLock);
+        errno = EEXIST;
+        return list;
+    }
 
-        if (TOID_IS_NULL(prev)) {
-            break; // Empty list
+    TX_BEGIN(pop) {
+        if (TOID_IS_NULL(D_RO(pool)->dir)) {
+            TX_SET(pool, dir, TX_ZNEW(struct list_dir));
         }
+        TOID(struct list_dir) dir = D_RO(pool)->dir;
+        uint64_t bucket = dirBucket(name);
 
-        curr = getNextPtr(prev);
-        while (!TOID_IS_NULL(curr)) {
-            next = getNextPtr(curr);
+        TOID(struct list_dir_entry) entry = TX_ZNEW(struct list_dir_entry);
+        strncpy(D_RW(entry)->name, name, LIST_NAME_MAX - 1);
+        D_RW(entry)->list = TX_ZNEW(struct list_root);
+        D_RW(entry)->next = D_RO(dir)->buckets[bucket];
 
-            if (isMarked(curr)) {
-                TX_BEGIN(pop) {
-                    TX_ADD_FIELD(prev, next);
-                    TOID(struct list_node) expected = curr;
-                    if (!atomic_compare_exchange_strong(&D_RW(prev)->next,
-                                                        &expected, next)) {
-                        retry = true;
-                        TX_ABORT(EINVAL);
-                    }
-                    TX_FREE(curr);
-                    removed_count++;
-                }
-                TX_ONABORT {
-                    retry = true;
-                    break;
-                }
-                TX_END
+        TX_ADD_FIELD(dir, buckets[bucket]);
+        D_RW(dir)->buckets[bucket] = entry;
+        TX_SET(dir, count, D_RO(dir)->count + 1);
+        list = D_RO(entry)->list;
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Transaction aborted when creating list %s\n", name);
+        abort();
+    }
+    TX_END
 
-                if (retry) {
-                    break;
-                }
-                curr = next;
-            } else {
-                prev = curr;
+    struct list_state *state = listState(list);
+    setCounts(state, 0, 0);
+    state->opened = true;
+    pthread_mutex_unlock(&dirLock);
+
+    return list;
+}
+
+/*
+ * Free the nodes of the list in pool->dropping DROP_CHUNK at a time, each
+ * chunk in its own transaction that also advances the list's head past it,
+ * then free the list itself and clear dropping. A crash in between leaves a
+ * shorter list for recoverLists to finish.
+ */
+#define DROP_CHUNK 1024
+
+static void finishDrop(PMEMobjpool *pop, TOID(struct pool_root) pool) {
+    TOID(struct list_root) list = D_RO(pool)->dropping;
+
+    while (!TOID_IS_NULL(D_RO(list)->head)) {
+        TX_BEGIN(pop) {
+            TOID(struct list_node) curr = D_RO(list)->head;
+            for (int i = 0; i < DROP_CHUNK && !TOID_IS_NULL(curr); i++) {
+                TOID(struct list_node) next = getNextPtr(curr);
+                TX_FREE(curr);
                 curr = next;
             }
+            TX_SET(list, head, curr);
         }
-
-        if (!retry) {
-            break;
+        TX_ONABORT {
+            fprintf(stderr, "Transaction aborted when freeing list nodes\n");
+            abort();
         }
+        TX_END
     }
 
-    return removed_count;
+    TX_BEGIN(pop) {
+        TX_FREE(D_RO(list)->log);
+        TX_FREE(D_RO(list)->filter);
+        TX_FREE(list);
+        TX_SET(pool, dropping, TOID_NULL(struct list_root));
+    }
+    TX_ONABORT {
+        fprintf(stderr, "Transaction aborted when freeing a dropped list\n");
+        abort();
+    }
+    TX_END
 }
 
-void traverseList(TOID(struct list_root) root) {
-    TOID(struct list_node) curr = D_RO(root)->head;
+/*
+ * Remove a named list from the directory and free it with all of its nodes
+ * and filters. Callers must have stopped using the list. Returns false if no
+ * list has that name.
+ */
+bool dropNamedList(PMEMobjpool *pop, TOID(struct pool_root) pool,
+                   const char *name) {
+    bool dropped = false;
 
-    if (TOID_IS_NULL(curr)) {
-        printf("Empty list\n");
-        return;
+    pthread_mutex_lock(&dirLock);
+    TOID(struct list_dir_entry) entry = dirLookup(pool, name);
+    if (TOID_IS_NULL(entry)) {
+        pthread_mutex_unlock(&dirLock);
+        return false;
     }
 
-    while (!TOID_IS_NULL(curr)) {
-        if (!isMarked(curr)) {
-            printf("{%d}", D_RO(curr)->value);
-            TOID(struct list_node) next = getNextPtr(curr);
-            if (!TOID_IS_NULL(next) && !isMarked(next)) {
-                printf("->");
+    TOID(struct list_root) list = D_RO(entry)->list;
+    TX_BEGIN(pop) {
+        TOID(struct list_dir) dir = D_RO(pool)->dir;
+        uint64_t bucket = dirBucket(name);
+
+        if (TOID_EQUALS(D_RO(dir)->buckets[bucket], entry)) {
+            TX_ADD_FIELD(dir, buckets[bucket]);
+            D_RW(dir)->buckets[bucket] = D_RO(entry)->next;
+        } else {
+            TOID(struct list_dir_entry) prev = D_RO(dir)->buckets[bucket];
+            while (!TOID_EQUALS(D_RO(prev)->next, entry)) {
+                prev = D_RO(prev)->next;
             }
+            TX_SET(prev, next, D_RO(entry)->next);
         }
-        curr = getNextPtr(curr);
+        TX_SET(dir, count, D_RO(dir)->count - 1);
+        TX_SET(pool, dropping, list);
+        TX_FREE(entry);
     }
-    printf("\n");
+    TX_ONCOMMIT { dropped = true; }
+    TX_ONABORT {
+        fprintf(stderr, "Transaction aborted when dropping list %s\n", name);
+        abort();
+    }
+    TX_END
+    finishDrop(pop, pool);
+    listState(list)->opened = false;
+    pthread_mutex_unlock(&dirLock);
+
+    return dropped;
 }
 
-void cleanupList(PMEMobjpool *pop, TOID(struct list_root) root) {
-    TOID(struct list_node) current = D_RO(root)->head;
-    TOID(struct list_node) next;
+void printNamedLists(TOID(struct pool_root) pool) {
+    if (TOID_IS_NULL(D_RO(pool)->dir) || D_RO(D_RO(pool)->dir)->count == 0) {
+        printf("No named lists\n");
+        return;
+    }
 
-    TX_BEGIN(pop) {
-        while (!TOID_IS_NULL(current)) {
-            next = getNextPtr(current);
-            TX_FREE(current);
-            current = next;
+    const struct list_dir *dir = D_RO(D_RO(pool)->dir);
+    for (uint64_t i = 0; i < LIST_DIR_BUCKETS; i++) {
+        TOID(struct list_dir_entry) entry = dir->buckets[i];
+        while (!TOID_IS_NULL(entry)) {
+            printf("%s\n", D_RO(entry)->name);
+            entry = D_RO(entry)->next;
         }
-        TX_SET(root, head, TOID_NULL(struct list_node));
     }
-    TX_ONABORT {
-        fprintf(stderr, "Transaction aborted during cleanup\n");
-        abort();
+}
+
+/*
+ * Recover the pool's own list and, after an unclean shutdown, free the nodes
+ * that were unlinked but not yet reclaimed and finish a list drop that was
+ * cut short. Named lists are recovered when openNamedList first opens them,
+ * so opening a pool does not depend on how many lists it holds. Returns the
+ * replayed op count.
+ */
+int recoverLists(PMEMobjpool *pop, TOID(struct pool_root) pool) {
+    if (!D_RO(pool)->clean_shutdown) {
+        freeDetachedNodes(pop);
     }
-    TX_END
+    if (!TOID_IS_NULL(D_RO(pool)->dropping)) {
+        finishDrop(pop, pool);
+    }
+    int replayed = recoverList(pop, poolList(pool));
+
+    D_RW(pool)->clean_shutdown = 0;
+    pmemobj_persist(pop, &D_RW(pool)->clean_shutdown,
+                    sizeof(D_RO(pool)->clean_shutdown));
+
+    return replayed;
+}
+
+/*
+ * Free the pool's retired nodes, write back the counts of every list opened
+ * in this session and record a clean shutdown. Lists that were not opened
+ * keep the counts they have. Call before pmemobj_close once all readers and
+ * writers have stopped.
+ */
+void closeLists(PMEMobjpool *pop, TOID(struct pool_root) pool) {
+    freePoolRetired(pop);
+
+    for (int i = 0; i < LIST_STATE_BUCKETS; i++) {
+        for (struct list_state *state = atomic_load(&listStates[i]);
+             state != NULL; state = state->next) {
+            if (!state->opened ||
+                state->root.pool_uuid_lo != pool.oid.pool_uuid_lo) {
+                continue;
+            }
+            TOID(struct list_root) list;
+            TOID_ASSIGN(list, state->root);
+
+            int64_t live, marked;
+            listSize(list, &live, &marked);
+            D_RW(list)->live = live;
+            D_RW(list)->marked = marked;
+            pmemobj_persist(pop, &D_RW(list)->live,
+                            2 * sizeof(D_RO(list)->live));
+            D_RW(list)->counts_valid = 1;
+            pmemobj_persist(pop, &D_RW(list)->counts_valid,
+                            sizeof(D_RO(list)->counts_valid));
+            state->opened = false;
+        }
+    }
+
+    D_RW(pool)->clean_shutdown = 1;
+    pmemobj_persist(pop, &D_RW(pool)->clean_shutdown,
+                    sizeof(D_RO(pool)->clean_shutdown));
 }
 
+// the tests build this file with PMEM_LL_NO_MAIN to reach the list API
+#ifndef PMEM_LL_NO_MAIN
 static void print_help(void) {
-    printf("usage: persistent_lockfree_list <pool> <option> [<value>]\n");
+    printf("usage: persistent_lockfree_list <pool> [use <name>] <option> "
+           "[<value>]\n");
+    printf("\tuse <name> - Apply the option to the named list <name>\n");
     printf("\tAvailable options:\n");
     printf("\tinsert <value> - Insert integer value into the list\n");
     printf("\tdelete <value> - Mark node with value for deletion\n");
+    printf("\tdelete-range <lo> <hi> - Delete every value in [lo, hi]\n");
     printf("\tcleanup - Remove all marked nodes\n");
     printf("\tfind <value> - Find value in the list\n");
     printf("\tprint - Print all unmarked values in the list\n");
+    printf("\tsize - Print the number of live and marked nodes\n");
     printf("\tclear - Remove all nodes from the list\n");
+    printf("\texport <file> - Write a snapshot of all unmarked values\n");
+    printf("\timport <file> - Append all values from a snapshot file\n");
+    printf("\tfilter - Attach a negative-lookup filter to the list\n");
+    printf("\tcreate-list <name> - Create a named list in the pool\n");
+    printf("\tdrop-list <name> - Free a named list and all of its nodes\n");
+    printf("\tlists - Print the names of all named lists\n");
 }
 
 int main(int argc, const char *argv[]) {
@@ -293,19 +2683,43 @@ int main(int argc, const char *argv[]) {
 
     // Create or open the persistent memory pool
     if (file_exists(path) != 0) {
-        if ((pop = pmemobj_create(path, POBJ_LAYOUT_NAME(list),
+        if ((pop = pmemobj_create(path, POBJ_LAYOUT_NAME(list_v2),
                                   PMEMOBJ_MIN_POOL, 0666)) == NULL) {
             perror("failed to create pool\n");
             return -1;
         }
     } else {
-        if ((pop = pmemobj_open(path, POBJ_LAYOUT_NAME(list))) == NULL) {
+        if ((pop = pmemobj_open(path, POBJ_LAYOUT_NAME(list_v2))) == NULL) {
             perror("failed to open pool\n");
             return -1;
         }
     }
 
-    TOID(struct list_root) root = POBJ_ROOT(pop, struct list_root);
+    TOID(struct pool_root) pool = POBJ_ROOT(pop, struct pool_root);
+    TOID(struct list_root) root = poolList(pool);
+
+    int replayed = recoverLists(pop, pool);
+    if (replayed > 0) {
+        printf("Replayed %d logged operations\n", replayed);
+    }
+
+    if (strcmp(argv[2], "use") == 0) {
+        if (argc < 5) {
+            print_help();
+            closeLists(pop, pool);
+            pmemobj_close(pop);
+            return 0;
+        }
+        root = openNamedList(pop, pool, argv[3]);
+        if (TOID_IS_NULL(root)) {
+            fprintf(stderr, "List %s does not exist\n", argv[3]);
+            closeLists(pop, pool);
+            pmemobj_close(pop);
+            return -1;
+        }
+        argv += 2;
+        argc -= 2;
+    }
 
     if (strcmp(argv[2], "insert") == 0) {
         if (argc == 4) {
@@ -326,6 +2740,15 @@ int main(int argc, const char *argv[]) {
         } else {
             print_help();
         }
+    } else if (strcmp(argv[2], "delete-range") == 0) {
+        if (argc == 5) {
+            int lo = atoi(argv[3]);
+            int hi = atoi(argv[4]);
+            int count = deleteRange(pop, root, lo, hi);
+            printf("Deleted %d values in [%d, %d]\n", count, lo, hi);
+        } else {
+            print_help();
+        }
     } else if (strcmp(argv[2], "cleanup") == 0) {
         int count = removeMarkedNodes(pop, root);
         printf("Removed %d marked nodes from the list\n", count);
@@ -344,13 +2767,67 @@ int main(int argc, const char *argv[]) {
     } else if (strcmp(argv[2], "print") == 0) {
         printf("List contents: ");
         traverseList(root);
+    } else if (strcmp(argv[2], "size") == 0) {
+        int64_t live, marked;
+        listSize(root, &live, &marked);
+        printf("List size: %lld live, %lld marked\n", (long long)live,
+               (long long)marked);
     } else if (strcmp(argv[2], "clear") == 0) {
         cleanupList(pop, root);
         printf("List cleared\n");
+    } else if (strcmp(argv[2], "filter") == 0) {
+        attachFilter(pop, root);
+        printf("Filter attached to the list\n");
+    } else if (strcmp(argv[2], "create-list") == 0) {
+        if (argc == 4) {
+            if (!TOID_IS_NULL(createNamedList(pop, pool, argv[3]))) {
+                printf("Created list %s\n", argv[3]);
+            } else {
+                perror("failed to create list");
+            }
+        } else {
+            print_help();
+        }
+    } else if (strcmp(argv[2], "drop-list") == 0) {
+        if (argc == 4) {
+            if (dropNamedList(pop, pool, argv[3])) {
+                printf("Dropped list %s\n", argv[3]);
+            } else {
+                printf("List %s does not exist\n", argv[3]);
+            }
+        } else {
+            print_help();
+        }
+    } else if (strcmp(argv[2], "lists") == 0) {
+        printNamedLists(pool);
+    } else if (strcmp(argv[2], "export") == 0) {
+        if (argc == 4) {
+            long count = exportSnapshot(root, argv[3]);
+            if (count >= 0) {
+                printf("Exported %ld values to %s\n", count, argv[3]);
+            } else {
+                perror("failed to export snapshot");
+            }
+        } else {
+            print_help();
+        }
+    } else if (strcmp(argv[2], "import") == 0) {
+        if (argc == 4) {
+            long count = importSnapshot(pop, root, argv[3]);
+            if (count >= 0) {
+                printf("Imported %ld values from %s\n", count, argv[3]);
+            } else {
+                perror("failed to import snapshot");
+            }
+        } else {
+            print_help();
+        }
     } else {
         print_help();
     }
 
+    closeLists(pop, pool);
     pmemobj_close(pop);
     return 0;
-}
\ No newline at end of file
+}
+#endif /* PMEM_LL_NO_MAIN */
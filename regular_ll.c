@@ -1,14 +1,79 @@
+#include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 typedef struct node {
     int value;
     _Atomic(struct node *) next;
 } Node;
 
+#define COMBINER_SLOTS 64
+#define COMBINER_SPINS 128
+
+// one publication slot per thread, padded to its own cache line
+typedef struct combiner_slot {
+    _Alignas(64) _Atomic(Node *) pending;
+} CombinerSlot;
+
+typedef struct combiner {
+    Node *head;
+    atomic_bool busy;
+    CombinerSlot slots[COMBINER_SLOTS];
+} Combiner;
+
+#define COUNTER_SHARDS 16
+
+// per-thread shard of a list's live/marked counts, on its own cache line
+typedef struct counter_shard {
+    _Alignas(64) atomic_long live;
+    atomic_long marked;
+} CounterShard;
+
+typedef struct list_counters {
+    CounterShard shards[COUNTER_SHARDS];
+} ListCounters;
+
+#define JOURNAL_SHARDS 16
+#define JOURNAL_BLOCK 256
+
+typedef struct change {
+    int value;
+    bool inserted;
+} Change;
+
+typedef struct change_block {
+    size_t count;
+    struct change_block *next;
+    Change changes[JOURNAL_BLOCK];
+} ChangeBlock;
+
+// blocks of changes journaled by the threads of one shard, on its own
+// cache line
+typedef struct journal_shard {
+    _Alignas(64) pthread_mutex_t lock;
+    ChangeBlock *first;
+    ChangeBlock *last;
+} JournalShard;
+
+typedef struct change_journal {
+    JournalShard shards[JOURNAL_SHARDS];
+} ChangeJournal;
+
+#define LIST_STATE_BUCKETS 1024
+
+// optional per-list state, found by the list's head
+typedef struct list_state {
+    Node *head;
+    _Atomic(ListCounters *) counters;
+    _Atomic(ChangeJournal *) journal;
+    struct list_state *next;
+} ListState;
+
 Node *createNode(int value) {
     Node *res = (Node *)malloc(sizeof(Node));
     if (res == NULL) {
@@ -35,8 +100,501 @@ static inline Node *getMarkedPtr(Node *node) {
     return (Node *)((uintptr_t)node | 0x1);
 }
 
-void insertValue(Node *head, int value) {
-    Node *newNode = createNode(value);
+// The head is never unlinked, since callers hold it as the list. Once its
+// own value is deleted, links out of it keep the mark: the value to store in
+// prev->next for a link to node.
+static inline Node *linkFrom(Node *head, Node *prev, Node *node) {
+    return prev == head && isMarked(head) ? getMarkedPtr(node) : node;
+}
+
+// the head of an empty list: a node whose value is already deleted
+Node *createEmptyList(void) {
+    Node *head = createNode(0);
+    atomic_store(&head->next, getMarkedPtr(NULL));
+    return head;
+}
+
+// nodes a thread unlinked during one global epoch, waiting to be freed
+typedef struct retired_nodes {
+    Node **nodes;
+    size_t count;
+    size_t capacity;
+    unsigned long epoch;
+} RetiredNodes;
+
+// Per-thread state. A record is claimed by a thread on first use and handed
+// back by a key destructor when the thread exits, so indexes stay dense and
+// are reused by later threads. Retired nodes stay with the record and are
+// freed by whichever thread owns it next.
+typedef struct thread_record {
+    _Alignas(64) atomic_ulong epoch; // (epoch << 1 | 1) inside a walk, else 0
+    int index;
+    int nesting;
+    atomic_bool in_use;
+    size_t retired_since_advance;
+    RetiredNodes retired[3];
+    struct thread_record *next;
+} ThreadRecord;
+
+static _Atomic(ThreadRecord *) threadRecords;
+static atomic_int threadRecordCount;
+static pthread_key_t threadRecordKey;
+static pthread_once_t threadRecordOnce = PTHREAD_ONCE_INIT;
+static _Thread_local ThreadRecord *threadRecord;
+
+static void releaseThreadRecord(void *arg) {
+    atomic_store(&((ThreadRecord *)arg)->in_use, false);
+}
+
+static void createThreadRecordKey(void) {
+    if (pthread_key_create(&threadRecordKey, releaseThreadRecord) != 0) {
+        perror("Failed to create thread record key");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// claim a free record, preferring one with an index below limit
+static ThreadRecord *claimThreadRecord(int limit) {
+    for (ThreadRecord *rec = atomic_load(&threadRecords); rec != NULL;
+         rec = rec->next) {
+        bool expected = false;
+        if (rec->index < limit && !atomic_load(&rec->in_use) &&
+            atomic_compare_exchange_strong(&rec->in_use, &expected, true)) {
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+static ThreadRecord *getThreadRecord(void) {
+    if (threadRecord != NULL) {
+        return threadRecord;
+    }
+    pthread_once(&threadRecordOnce, createThreadRecordKey);
+
+    ThreadRecord *rec = claimThreadRecord(COMBINER_SLOTS);
+    if (rec == NULL) {
+        rec = claimThreadRecord(INT32_MAX);
+    }
+    if (rec == NULL) {
+        rec = (ThreadRecord *)aligned_alloc(64, sizeof(ThreadRecord));
+        if (rec == NULL) {
+            perror("Failed to allocate memory for thread record");
+            exit(EXIT_FAILURE);
+        }
+        memset(rec, 0, sizeof(ThreadRecord));
+        rec->index = atomic_fetch_add(&threadRecordCount, 1);
+        atomic_store(&rec->in_use, true);
+        rec->next = atomic_load(&threadRecords);
+        while (!atomic_compare_exchange_weak(&threadRecords, &rec->next, rec)) {
+        }
+    }
+
+    pthread_setspecific(threadRecordKey, rec);
+    threadRecord = rec;
+    return rec;
+}
+
+/*
+ * Epoch-based reclamation. A node unlinked while other threads may still be
+ * walking over it is retired rather than freed. Every walk runs between
+ * enterEpoch and exitEpoch, which announce the global epoch in the thread's
+ * record. The global epoch only moves on once every thread inside a walk has
+ * announced it, so a node retired in epoch e can be freed when the global
+ * epoch reaches e + 2: no walk that could have reached it is still running.
+ */
+#define RETIRE_BATCH 64
+
+static atomic_ulong globalEpoch;
+
+static void freeRetired(RetiredNodes *batch) {
+    for (size_t i = 0; i < batch->count; i++) {
+        free(batch->nodes[i]);
+    }
+    batch->count = 0;
+}
+
+static void reclaimRetired(ThreadRecord *rec) {
+    unsigned long epoch = atomic_load(&globalEpoch);
+    for (int i = 0; i < 3; i++) {
+        if (rec->retired[i].count > 0 && rec->retired[i].epoch + 2 <= epoch) {
+            freeRetired(&rec->retired[i]);
+        }
+    }
+}
+
+// move the global epoch on if every thread inside a walk has announced it
+static void advanceEpoch(void) {
+    unsigned long epoch = atomic_load(&globalEpoch);
+    for (ThreadRecord *rec = atomic_load(&threadRecords); rec != NULL;
+         rec = rec->next) {
+        unsigned long seen = atomic_load(&rec->epoch);
+        if ((seen & 1) && (seen >> 1) != epoch) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&globalEpoch, &epoch, epoch + 1);
+}
+
+static ThreadRecord *enterEpoch(void) {
+    ThreadRecord *rec = getThreadRecord();
+    if (rec->nesting++ == 0) {
+        atomic_store(&rec->epoch, atomic_load(&globalEpoch) << 1 | 1);
+        reclaimRetired(rec);
+    }
+    return rec;
+}
+
+static void exitEpoch(ThreadRecord *rec) {
+    if (--rec->nesting == 0) {
+        atomic_store_explicit(&rec->epoch, 0, memory_order_release);
+    }
+}
+
+// free an unlinked node once no walk can still be reading it
+static void retireNode(Node *node) {
+    ThreadRecord *rec = getThreadRecord();
+    unsigned long epoch = atomic_load(&globalEpoch);
+    RetiredNodes *batch = &rec->retired[epoch % 3];
+
+    // a batch left over from epoch - 3 or earlier is already safe to free
+    if (batch->count > 0 && batch->epoch != epoch) {
+        freeRetired(batch);
+    }
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity > 0 ? 2 * batch->capacity : 16;
+        Node **nodes =
+            (Node **)realloc(batch->nodes, capacity * sizeof(Node *));
+        if (nodes == NULL) {
+            perror("Failed to allocate memory for retired nodes");
+            exit(EXIT_FAILURE);
+        }
+        batch->nodes = nodes;
+        batch->capacity = capacity;
+    }
+    batch->nodes[batch->count++] = node;
+    batch->epoch = epoch;
+
+    if (++rec->retired_since_advance >= RETIRE_BATCH) {
+        rec->retired_since_advance = 0;
+        advanceEpoch();
+        reclaimRetired(rec);
+    }
+}
+
+/*
+ * The state of every tracked list, in a fixed-size hash table keyed by the
+ * head as in pmem_ll.c, so finding it costs one bucket load whether or not
+ * the list is tracked. Entries are published with a CAS and never freed, so
+ * lookups take no lock; untracking only clears the entry's pointers, and a
+ * later list reusing the head's address reuses the entry.
+ */
+static _Atomic(ListState *) listStates[LIST_STATE_BUCKETS];
+
+static _Atomic(ListState *) *listStateBucket(Node *head) {
+    uint64_t h = (uint64_t)(uintptr_t)head >> 4;
+    return &listStates[(h ^ (h >> 32)) % LIST_STATE_BUCKETS];
+}
+
+// the list's state, or NULL if none of it was ever tracked
+static ListState *findListState(Node *head) {
+    for (ListState *state = atomic_load(listStateBucket(head)); state != NULL;
+         state = state->next) {
+        if (state->head == head) {
+            return state;
+        }
+    }
+    return NULL;
+}
+
+// the list's state, created on first use
+static ListState *listState(Node *head) {
+    _Atomic(ListState *) *bucket = listStateBucket(head);
+    ListState *first = atomic_load(bucket);
+    for (ListState *s = first; s != NULL; s = s->next) {
+        if (s->head == head) {
+            return s;
+        }
+    }
+
+    ListState *state = (ListState *)malloc(sizeof(ListState));
+    if (state == NULL) {
+        perror("Failed to allocate memory for list state");
+        exit(EXIT_FAILURE);
+    }
+    state->head = head;
+    atomic_store(&state->counters, NULL);
+    atomic_store(&state->journal, NULL);
+
+    // entries only ever go in front, so on a failed CAS just the new ones
+    // need to be checked for a racing insert of the same head
+    while (true) {
+        state->next = first;
+        if (atomic_compare_exchange_weak(bucket, &state->next, state)) {
+            return state;
+        }
+        ListState *seen = state->next;
+        for (ListState *s = seen; s != first; s = s->next) {
+            if (s->head == head) {
+                free(state);
+                return s;
+            }
+        }
+        first = seen;
+    }
+}
+
+static atomic_int nextCounterShard;
+static _Thread_local int counterShard = -1;
+
+static ListCounters *countersFor(Node *head) {
+    ListState *state = findListState(head);
+    return state != NULL ? atomic_load(&state->counters) : NULL;
+}
+
+// adjust the counts of a tracked list from the calling thread's shard
+static void countNodes(Node *head, long live, long marked) {
+    ListCounters *counters = countersFor(head);
+    if (counters == NULL) {
+        return;
+    }
+    if (counterShard == -1) {
+        counterShard = atomic_fetch_add(&nextCounterShard, 1) % COUNTER_SHARDS;
+    }
+    CounterShard *shard = &counters->shards[counterShard];
+    if (live != 0) {
+        atomic_fetch_add_explicit(&shard->live, live, memory_order_relaxed);
+    }
+    if (marked != 0) {
+        atomic_fetch_add_explicit(&shard->marked, marked,
+                                  memory_order_relaxed);
+    }
+}
+
+// walk the list once to count its live and marked nodes
+static void countList(Node *head, long *live, long *marked) {
+    *live = 0;
+    *marked = 0;
+    for (Node *curr = head; curr != NULL; curr = getNextPtr(curr)) {
+        if (isMarked(curr)) {
+            (*marked)++;
+        } else {
+            (*live)++;
+        }
+    }
+}
+
+static void countListInEpoch(Node *head, long *live, long *marked) {
+    ThreadRecord *rec = enterEpoch();
+    countList(head, live, marked);
+    exitEpoch(rec);
+}
+
+// start keeping O(1) size counts for the list; call before the list is
+// shared between threads. Returns false if its size is already tracked
+bool trackListSize(Node *head) {
+    ListState *state = listState(head);
+    if (atomic_load(&state->counters) != NULL) {
+        return false;
+    }
+
+    ListCounters *counters =
+        (ListCounters *)aligned_alloc(64, sizeof(ListCounters));
+    if (counters == NULL) {
+        perror("Failed to allocate memory for list counters");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < COUNTER_SHARDS; i++) {
+        atomic_store(&counters->shards[i].live, 0);
+        atomic_store(&counters->shards[i].marked, 0);
+    }
+
+    long live, marked;
+    countListInEpoch(head, &live, &marked);
+    atomic_store(&counters->shards[0].live, live);
+    atomic_store(&counters->shards[0].marked, marked);
+
+    ListCounters *expected = NULL;
+    if (!atomic_compare_exchange_strong(&state->counters, &expected,
+                                        counters)) {
+        free(counters);
+        return false;
+    }
+    return true;
+}
+
+// stop tracking the list; no other thread may be using it
+void untrackListSize(Node *head) {
+    ListState *state = findListState(head);
+    if (state != NULL) {
+        free(atomic_exchange(&state->counters, NULL));
+    }
+}
+
+// live and marked node counts: summed shards for tracked lists, otherwise
+// a full traversal
+void listSize(Node *head, long *live, long *marked) {
+    ListCounters *counters = countersFor(head);
+    if (counters == NULL) {
+        countListInEpoch(head, live, marked);
+        return;
+    }
+
+    *live = 0;
+    *marked = 0;
+    for (int i = 0; i < COUNTER_SHARDS; i++) {
+        *live += atomic_load(&counters->shards[i].live);
+        *marked += atomic_load(&counters->shards[i].marked);
+    }
+}
+
+static ChangeJournal *journalFor(Node *head) {
+    ListState *state = findListState(head);
+    return state != NULL ? atomic_load(&state->journal) : NULL;
+}
+
+// record an insert or delete of value in the list's journal, if it has one.
+// Each thread appends to the block of its own shard, so journaling takes an
+// uncontended lock and allocates once per JOURNAL_BLOCK changes. Inserts are
+// recorded before the node is linked and deletes after the node is marked,
+// so a delete is never taken ahead of the insert it undoes
+static void journalChange(Node *head, int value, bool inserted) {
+    ChangeJournal *journal = journalFor(head);
+    if (journal == NULL) {
+        return;
+    }
+
+    JournalShard *shard =
+        &journal->shards[getThreadRecord()->index % JOURNAL_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    ChangeBlock *block = shard->last;
+    if (block == NULL || block->count == JOURNAL_BLOCK) {
+        block = (ChangeBlock *)malloc(sizeof(ChangeBlock));
+        if (block == NULL) {
+            perror("Failed to allocate memory for journal block");
+            exit(EXIT_FAILURE);
+        }
+        block->count = 0;
+        block->next = NULL;
+        if (shard->last == NULL) {
+            shard->first = block;
+        } else {
+            shard->last->next = block;
+        }
+        shard->last = block;
+    }
+    block->changes[block->count].value = value;
+    block->changes[block->count].inserted = inserted;
+    block->count++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void freeChanges(ChangeBlock *changes) {
+    while (changes != NULL) {
+        ChangeBlock *next = changes->next;
+        free(changes);
+        changes = next;
+    }
+}
+
+// start journaling inserts and deletes on the list; call before the list is
+// shared between threads. Returns false if it is already journaled
+bool trackListChanges(Node *head) {
+    ListState *state = listState(head);
+    if (atomic_load(&state->journal) != NULL) {
+        return false;
+    }
+
+    ChangeJournal *journal =
+        (ChangeJournal *)aligned_alloc(64, sizeof(ChangeJournal));
+    if (journal == NULL) {
+        perror("Failed to allocate memory for change journal");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < JOURNAL_SHARDS; i++) {
+        pthread_mutex_init(&journal->shards[i].lock, NULL);
+        journal->shards[i].first = NULL;
+        journal->shards[i].last = NULL;
+    }
+
+    ChangeJournal *expected = NULL;
+    if (!atomic_compare_exchange_strong(&state->journal, &expected,
+                                        journal)) {
+        for (int i = 0; i < JOURNAL_SHARDS; i++) {
+            pthread_mutex_destroy(&journal->shards[i].lock);
+        }
+        free(journal);
+        return false;
+    }
+    return true;
+}
+
+// detach everything journaled so far as one chain of blocks, the blocks of
+// each shard oldest first; the caller releases it with freeChanges. Changes
+// from different shards are not ordered, but all shards are taken at once,
+// so a delete is never taken without the insert of its node
+ChangeBlock *takeListChanges(Node *head) {
+    ChangeJournal *journal = journalFor(head);
+    if (journal == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < JOURNAL_SHARDS; i++) {
+        pthread_mutex_lock(&journal->shards[i].lock);
+    }
+
+    ChangeBlock *first = NULL;
+    ChangeBlock **link = &first;
+    for (int i = 0; i < JOURNAL_SHARDS; i++) {
+        JournalShard *shard = &journal->shards[i];
+        if (shard->first != NULL) {
+            *link = shard->first;
+            link = &shard->last->next;
+            shard->first = NULL;
+            shard->last = NULL;
+        }
+    }
+
+    for (int i = 0; i < JOURNAL_SHARDS; i++) {
+        pthread_mutex_unlock(&journal->shards[i].lock);
+    }
+    return first;
+}
+
+// stop journaling the list and drop the changes not yet taken; no other
+// thread may be using it
+void untrackListChanges(Node *head) {
+    ListState *state = findListState(head);
+    ChangeJournal *journal =
+        state != NULL ? atomic_exchange(&state->journal, NULL) : NULL;
+    if (journal == NULL) {
+        return;
+    }
+    for (int i = 0; i < JOURNAL_SHARDS; i++) {
+        freeChanges(journal->shards[i].first);
+        pthread_mutex_destroy(&journal->shards[i].lock);
+    }
+    free(journal);
+}
+
+// help a concurrent delete by unlinking the marked node curr from prev and
+// retiring it; returns prev's new successor, or curr if prev no longer
+// points to it
+static Node *unlinkMarked(Node *head, Node *prev, Node *curr) {
+    Node *expected = linkFrom(head, prev, curr);
+    Node *next = getNextPtr(curr);
+
+    if (atomic_compare_exchange_strong(&prev->next, &expected,
+                                       linkFrom(head, prev, next))) {
+        retireNode(curr);
+        countNodes(head, 0, -1);
+        return next;
+    }
+    return curr;
+}
+
+// link an already built chain starting at first after the current tail
+static void appendChain(Node *head, Node *first) {
     Node *prev, *curr;
 
     while (true) {
@@ -44,43 +602,272 @@ void insertValue(Node *head, int value) {
         curr = getNextPtr(prev);
 
         while (curr != NULL) {
-            if (isMarked(prev)) {
+            if (isMarked(prev) && prev != head) {
                 break;
             }
+            if (isMarked(curr)) {
+                Node *succ = unlinkMarked(head, prev, curr);
+                if (succ != curr) {
+                    curr = succ;
+                    continue;
+                }
+            }
             prev = curr;
             curr = getNextPtr(curr);
         }
 
-        if (isMarked(prev)) {
+        if (isMarked(prev) && prev != head) {
             continue;
         }
 
-        if (atomic_compare_exchange_strong(&prev->next, &curr, newNode)) {
+        Node *expected = linkFrom(head, prev, curr);
+        if (atomic_compare_exchange_strong(&prev->next, &expected,
+                                           linkFrom(head, prev, first))) {
             return;
         }
     }
 }
 
-Node *findNode(Node *head, int value) {
-    Node *current = head;
+void insertValue(Node *head, int value) {
+    journalChange(head, value, true);
+    ThreadRecord *rec = enterEpoch();
+    appendChain(head, createNode(value));
+    exitEpoch(rec);
+    countNodes(head, 1, 0);
+}
 
-    while (current != NULL) {
-        if (current->value == value && !isMarked(current)) {
-            return current;
+// slot index of the calling thread, or -1 while COMBINER_SLOTS other live
+// threads hold the low thread records
+static int getCombinerSlot(void) {
+    int index = getThreadRecord()->index;
+    return index < COMBINER_SLOTS ? index : -1;
+}
+
+Combiner *createCombiner(Node *head) {
+    Combiner *res = (Combiner *)aligned_alloc(64, sizeof(Combiner));
+    if (res == NULL) {
+        perror("Failed to allocate memory for combiner");
+        exit(EXIT_FAILURE);
+    }
+    res->head = head;
+    atomic_store(&res->busy, false);
+    for (int i = 0; i < COMBINER_SLOTS; i++) {
+        atomic_store(&res->slots[i].pending, NULL);
+    }
+    return res;
+}
+
+void destroyCombiner(Combiner *combiner) { free(combiner); }
+
+// link every published node into one chain and append it with a single CAS
+static void combine(Combiner *combiner) {
+    Node *pending[COMBINER_SLOTS];
+    Node *first = NULL, *last = NULL;
+    long count = 0;
+
+    for (int i = 0; i < COMBINER_SLOTS; i++) {
+        pending[i] = atomic_load(&combiner->slots[i].pending);
+        if (pending[i] == NULL) {
+            continue;
+        }
+        if (first == NULL) {
+            first = pending[i];
+        } else {
+            atomic_store(&last->next, pending[i]);
         }
-        current = getNextPtr(current);
+        last = pending[i];
+        count++;
+    }
+
+    if (first == NULL) {
+        return;
+    }
+
+    ThreadRecord *rec = enterEpoch();
+    appendChain(combiner->head, first);
+    exitEpoch(rec);
+    countNodes(combiner->head, count, 0);
+
+    for (int i = 0; i < COMBINER_SLOTS; i++) {
+        if (pending[i] != NULL) {
+            atomic_store(&combiner->slots[i].pending, NULL);
+        }
+    }
+}
+
+// back off while a waiter polls its slot: pause for the first
+// COMBINER_SPINS polls, then give the core to the combiner
+static void waitForCombiner(int *spins) {
+    if (*spins < COMBINER_SPINS) {
+        (*spins)++;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+// flat-combining insert: publish the node and either wait for the current
+// combiner to link it or become the combiner and link everyone's nodes
+void insertValueCombined(Combiner *combiner, int value) {
+    int slot = getCombinerSlot();
+    if (slot < 0) {
+        insertValue(combiner->head, value);
+        return;
+    }
+
+    journalChange(combiner->head, value, true);
+    atomic_store(&combiner->slots[slot].pending, createNode(value));
+
+    int spins = 0;
+    while (atomic_load(&combiner->slots[slot].pending) != NULL) {
+        if (!atomic_load_explicit(&combiner->busy, memory_order_relaxed) &&
+            !atomic_exchange(&combiner->busy, true)) {
+            combine(combiner);
+            atomic_store(&combiner->busy, false);
+        } else {
+            waitForCombiner(&spins);
+        }
+    }
+}
+
+static Node *searchNode(Node *head, int value) {
+    if (head == NULL) {
+        return NULL;
+    }
+    if (head->value == value && !isMarked(head)) {
+        return head;
+    }
+
+    Node *prev = head;
+    Node *curr = getNextPtr(head);
+
+    while (curr != NULL) {
+        if (isMarked(curr)) {
+            Node *succ = unlinkMarked(head, prev, curr);
+            if (succ != curr) {
+                curr = succ;
+                continue;
+            }
+        } else if (curr->value == value) {
+            return curr;
+        }
+        prev = curr;
+        curr = getNextPtr(curr);
     }
 
     return NULL;
 }
 
-bool deleteValue(Node *head, int value) {
+// the node returned stays valid until it is deleted by another thread
+Node *findNode(Node *head, int value) {
+    ThreadRecord *rec = enterEpoch();
+    Node *res = searchNode(head, value);
+    exitEpoch(rec);
+    return res;
+}
+
+typedef struct lookup_key {
+    int key;
+    size_t index;
+} LookupKey;
+
+static int compareLookupKeys(const void *a, const void *b) {
+    int ka = ((const LookupKey *)a)->key, kb = ((const LookupKey *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+// resolve n lookups in one shared walk instead of n walks: the keys are
+// sorted once so every node is loaded a single time and matched with a
+// binary search. The lookups are not interleaved; the only overlap is the
+// prefetch of the successor while the current node is matched. Marked nodes
+// met on the way are unlinked as in findNode
+void findNodes(Node *head, const int *keys, size_t n, Node **results) {
+    for (size_t i = 0; i < n; i++) {
+        results[i] = NULL;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    LookupKey *sorted = (LookupKey *)malloc(n * sizeof(LookupKey));
+    if (sorted == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            results[i] = findNode(head, keys[i]);
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        sorted[i].key = keys[i];
+        sorted[i].index = i;
+    }
+    qsort(sorted, n, sizeof(LookupKey), compareLookupKeys);
+
+    size_t remaining = n;
+    ThreadRecord *rec = enterEpoch();
+    Node *prev = NULL;
+    Node *curr = head;
+
+    while (curr != NULL && remaining > 0) {
+        Node *next = getNextPtr(curr);
+        if (next != NULL) {
+            __builtin_prefetch(next);
+        }
+
+        if (isMarked(curr)) {
+            if (prev != NULL) {
+                Node *succ = unlinkMarked(head, prev, curr);
+                if (succ != curr) {
+                    curr = succ;
+                    continue;
+                }
+            }
+        } else {
+            size_t lo = 0, hi = n;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (sorted[mid].key < curr->value) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            for (; lo < n && sorted[lo].key == curr->value; lo++) {
+                if (results[sorted[lo].index] == NULL) {
+                    results[sorted[lo].index] = curr;
+                    remaining--;
+                }
+            }
+        }
+        prev = curr;
+        curr = next;
+    }
+    exitEpoch(rec);
+
+    free(sorted);
+}
+
+static bool markValue(Node *head, int value) {
     Node *curr, *next;
 
     while (true) {
+        Node *prev = NULL;
         curr = head;
 
-        while (curr != NULL && (curr->value != value || isMarked(curr))) {
+        while (curr != NULL) {
+            if (isMarked(curr)) {
+                if (prev != NULL) {
+                    Node *succ = unlinkMarked(head, prev, curr);
+                    if (succ != curr) {
+                        curr = succ;
+                        continue;
+                    }
+                }
+            } else if (curr->value == value) {
+                break;
+            }
+            prev = curr;
             curr = getNextPtr(curr);
         }
 
@@ -92,14 +879,75 @@ bool deleteValue(Node *head, int value) {
 
         if (atomic_compare_exchange_strong(&curr->next, &next,
                                            getMarkedPtr(next))) {
+            countNodes(head, -1, 1);
+            journalChange(head, value, false);
             return true;
         }
     }
 }
 
+bool deleteValue(Node *head, int value) {
+    ThreadRecord *rec = enterEpoch();
+    bool deleted = markValue(head, value);
+    exitEpoch(rec);
+    return deleted;
+}
+
+// mark every live node whose value satisfies pred and unlink it in the same
+// pass; returns the number of nodes deleted
+int deleteIf(Node *head, bool (*pred)(int value, void *arg), void *arg) {
+    int deleted = 0;
+    ThreadRecord *rec = enterEpoch();
+    Node *prev = NULL, *curr = head;
+
+    while (curr != NULL) {
+        Node *next = getNextPtr(curr);
+
+        if (!isMarked(curr) && pred(curr->value, arg)) {
+            if (!atomic_compare_exchange_strong(&curr->next, &next,
+                                                getMarkedPtr(next))) {
+                continue;
+            }
+            journalChange(head, curr->value, false);
+            deleted++;
+        }
+
+        if (isMarked(curr) && prev != NULL) {
+            Node *succ = unlinkMarked(head, prev, curr);
+            if (succ != curr) {
+                curr = succ;
+                continue;
+            }
+        }
+        prev = curr;
+        curr = getNextPtr(curr);
+    }
+    exitEpoch(rec);
+
+    countNodes(head, -deleted, deleted);
+    return deleted;
+}
+
+typedef struct value_range {
+    int lo;
+    int hi;
+} ValueRange;
+
+static bool inRange(int value, void *arg) {
+    ValueRange *range = (ValueRange *)arg;
+    return value >= range->lo && value <= range->hi;
+}
+
+// delete every value in [lo, hi]
+int deleteRange(Node *head, int lo, int hi) {
+    ValueRange range = {lo, hi};
+    return deleteIf(head, inRange, &range);
+}
+
 int removeMarkedNodes(Node *head) {
     int removed_count = 0;
     Node *prev, *curr, *next;
+    ThreadRecord *rec = enterEpoch();
 
     while (true) {
         bool retry = false;
@@ -110,12 +958,14 @@ int removeMarkedNodes(Node *head) {
             next = getNextPtr(curr);
 
             if (isMarked(curr)) {
-                if (!atomic_compare_exchange_strong(&prev->next, &curr, next)) {
+                Node *expected = linkFrom(head, prev, curr);
+                if (!atomic_compare_exchange_strong(
+                        &prev->next, &expected, linkFrom(head, prev, next))) {
                     retry = true;
                     break;
                 }
 
-                free(curr);
+                retireNode(curr);
                 removed_count++;
                 curr = next;
             } else {
@@ -128,11 +978,16 @@ int removeMarkedNodes(Node *head) {
             break;
         }
     }
+    exitEpoch(rec);
 
+    countNodes(head, 0, -removed_count);
     return removed_count;
 }
 
 void cleanupList(Node *head) {
+    untrackListSize(head);
+    untrackListChanges(head);
+
     Node *current = head;
     while (current != NULL) {
         Node *next = getNextPtr(current);
@@ -147,6 +1002,7 @@ void traverseNode(Node *head) {
         return;
     }
 
+    ThreadRecord *rec = enterEpoch();
     Node *curr = head;
     while (curr != NULL) {
         if (!isMarked(curr)) {
@@ -159,5 +1015,6 @@ void traverseNode(Node *head) {
         }
         curr = getNextPtr(curr);
     }
+    exitEpoch(rec);
     printf("\n");
 }
\ No newline at end of file
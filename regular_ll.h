@@ -1,8 +1,10 @@
 #ifndef LOCK_FREE_LIST_H
 #define LOCK_FREE_LIST_H
 
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct node {
@@ -10,22 +12,91 @@ typedef struct node {
     _Atomic(struct node *) next;
 } Node;
 
-Node *createNode(int value);
+#define COMBINER_SLOTS 64
+
+typedef struct combiner_slot {
+    _Alignas(64) _Atomic(Node *) pending;
+} CombinerSlot;
+
+typedef struct combiner {
+    Node *head;
+    atomic_bool busy;
+    CombinerSlot slots[COMBINER_SLOTS];
+} Combiner;
+
+#define COUNTER_SHARDS 16
 
-static inline Node *getNextPtr(Node *node);
+typedef struct counter_shard {
+    _Alignas(64) atomic_long live;
+    atomic_long marked;
+} CounterShard;
 
-static inline bool isMarked(Node *node);
+typedef struct list_counters {
+    CounterShard shards[COUNTER_SHARDS];
+} ListCounters;
+
+#define JOURNAL_SHARDS 16
+#define JOURNAL_BLOCK 256
+
+typedef struct change {
+    int value;
+    bool inserted;
+} Change;
 
-static inline Node *getMarkedPtr(Node *node);
+typedef struct change_block {
+    size_t count;
+    struct change_block *next;
+    Change changes[JOURNAL_BLOCK];
+} ChangeBlock;
+
+typedef struct journal_shard {
+    _Alignas(64) pthread_mutex_t lock;
+    ChangeBlock *first;
+    ChangeBlock *last;
+} JournalShard;
+
+typedef struct change_journal {
+    JournalShard shards[JOURNAL_SHARDS];
+} ChangeJournal;
+
+Node *createNode(int value);
+
+Node *createEmptyList(void);
 
 void insertValue(Node *head, int value);
 
+Combiner *createCombiner(Node *head);
+
+void destroyCombiner(Combiner *combiner);
+
+void insertValueCombined(Combiner *combiner, int value);
+
 Node *findNode(Node *head, int value);
 
+void findNodes(Node *head, const int *keys, size_t n, Node **results);
+
 bool deleteValue(Node *head, int value);
 
+int deleteIf(Node *head, bool (*pred)(int value, void *arg), void *arg);
+
+int deleteRange(Node *head, int lo, int hi);
+
 int removeMarkedNodes(Node *head);
 
+bool trackListSize(Node *head);
+
+void untrackListSize(Node *head);
+
+void listSize(Node *head, long *live, long *marked);
+
+bool trackListChanges(Node *head);
+
+ChangeBlock *takeListChanges(Node *head);
+
+void freeChanges(ChangeBlock *changes);
+
+void untrackListChanges(Node *head);
+
 void cleanupList(Node *head);
 
 void traverseNode(Node *head);
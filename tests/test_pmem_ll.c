@@ -0,0 +1,118 @@
+/*
+ * Tests for the persistent list in pmem_ll.c: inserts racing deletes of the
+ * same values, then a recovery round-trip through a clean and an unclean
+ * shutdown. The pool path is the first argument.
+ */
+#define PMEM_LL_NO_MAIN
+#include "../pmem_ll.c"
+
+#define THREADS 4
+#define VALUES 1000
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,  \
+                    #cond);                                                    \
+            exit(1);                                                           \
+        }                                                                      \
+    } while (0)
+
+static PMEMobjpool *pop;
+static TOID(struct list_root) root;
+static _Atomic int deleted;
+
+// every value in [VALUES, 2 * VALUES) is inserted by exactly one thread
+static void *inserter(void *arg) {
+    int id = (int)(long)arg;
+    for (int v = VALUES + id; v < 2 * VALUES; v += THREADS) {
+        insertValue(pop, root, v);
+    }
+    return NULL;
+}
+
+// every deleter tries every value in [0, VALUES); each must go exactly once
+static void *deleter(void *arg) {
+    (void)arg;
+    for (int v = 0; v < VALUES; v++) {
+        if (markNodeForDeletion(pop, root, v)) {
+            atomic_fetch_add(&deleted, 1);
+        }
+    }
+    return NULL;
+}
+
+// the counters must agree with a walk of the list
+static void checkList(int lo, int hi) {
+    int64_t live, marked, walked = 0;
+
+    for (TOID(struct list_node) curr = D_RO(root)->head; !TOID_IS_NULL(curr);
+         curr = getNextPtr(curr)) {
+        if (!isMarked(curr)) {
+            CHECK(D_RO(curr)->value >= lo && D_RO(curr)->value < hi);
+            walked++;
+        }
+    }
+    listSize(root, &live, &marked);
+    CHECK(live == walked);
+    CHECK(live == hi - lo);
+    for (int v = lo; v < hi; v++) {
+        CHECK(!TOID_IS_NULL(findNode(root, v)));
+    }
+}
+
+static TOID(struct pool_root) reopen(const char *path) {
+    pmemobj_close(pop);
+    pop = pmemobj_open(path, POBJ_LAYOUT_NAME(list_v2));
+    CHECK(pop != NULL);
+    TOID(struct pool_root) pool = POBJ_ROOT(pop, struct pool_root);
+    root = poolList(pool);
+    recoverLists(pop, pool);
+    return pool;
+}
+
+int main(int argc, const char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "test_pmem_ll.pool";
+    pthread_t threads[2 * THREADS];
+
+    unlink(path);
+    pop = pmemobj_create(path, POBJ_LAYOUT_NAME(list_v2),
+                         PMEMOBJ_MIN_POOL * 4, 0666);
+    CHECK(pop != NULL);
+    TOID(struct pool_root) pool = POBJ_ROOT(pop, struct pool_root);
+    root = poolList(pool);
+    recoverLists(pop, pool);
+
+    for (int v = 0; v < VALUES; v++) {
+        insertValue(pop, root, v);
+    }
+    for (long i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, inserter, (void *)i);
+        pthread_create(&threads[THREADS + i], NULL, deleter, (void *)i);
+    }
+    for (int i = 0; i < 2 * THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    CHECK(deleted == VALUES);
+    checkList(VALUES, 2 * VALUES);
+
+    // clean shutdown: the counts written back by closeLists are reused
+    removeMarkedNodes(pop, root);
+    closeLists(pop, pool);
+    pool = reopen(path);
+    checkList(VALUES, 2 * VALUES);
+
+    // unclean shutdown: no closeLists, so the counts are rebuilt by a walk
+    for (int v = 2 * VALUES; v < 3 * VALUES; v++) {
+        insertValue(pop, root, v);
+    }
+    pool = reopen(path);
+    CHECK(!D_RO(pool)->clean_shutdown);
+    checkList(VALUES, 3 * VALUES);
+
+    closeLists(pop, pool);
+    pmemobj_close(pop);
+    unlink(path);
+    printf("test_pmem_ll: OK\n");
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Concurrency tests for the lock-free list in regular_ll.c: inserts racing
+ * deletes of the same values, and the flat-combining insert path. The size
+ * counters are checked against a walk of the list after every run.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../regular_ll.h"
+
+#define THREADS 4
+#define VALUES 2000
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,  \
+                    #cond);                                                    \
+            exit(1);                                                           \
+        }                                                                      \
+    } while (0)
+
+static Node *head;
+static Combiner *combiner;
+static _Atomic int deleted;
+
+// every value in [VALUES, 2 * VALUES) is inserted by exactly one thread
+static void *inserter(void *arg) {
+    int id = (int)(long)arg;
+    for (int v = VALUES + id; v < 2 * VALUES; v += THREADS) {
+        insertValue(head, v);
+    }
+    return NULL;
+}
+
+// every deleter tries every value in [0, VALUES); each must go exactly once
+static void *deleter(void *arg) {
+    (void)arg;
+    for (int v = 0; v < VALUES; v++) {
+        if (deleteValue(head, v)) {
+            atomic_fetch_add(&deleted, 1);
+        }
+        if (v % 256 == 0) {
+            removeMarkedNodes(head);
+        }
+    }
+    return NULL;
+}
+
+static void *combinedInserter(void *arg) {
+    int id = (int)(long)arg;
+    for (int v = id; v < VALUES; v += THREADS) {
+        insertValueCombined(combiner, v);
+    }
+    return NULL;
+}
+
+static void checkCounters(void) {
+    long live, marked, walkedLive, walkedMarked;
+
+    listSize(head, &live, &marked);
+    untrackListSize(head);
+    listSize(head, &walkedLive, &walkedMarked);
+    CHECK(live == walkedLive);
+    CHECK(marked == walkedMarked);
+}
+
+static void testInsertDeleteRace(void) {
+    pthread_t threads[2 * THREADS];
+
+    head = createEmptyList();
+    for (int v = 0; v < VALUES; v++) {
+        insertValue(head, v);
+    }
+    CHECK(trackListSize(head));
+    deleted = 0;
+
+    for (long i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, inserter, (void *)i);
+        pthread_create(&threads[THREADS + i], NULL, deleter, (void *)i);
+    }
+    for (int i = 0; i < 2 * THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    CHECK(deleted == VALUES);
+    for (int v = 0; v < 2 * VALUES; v++) {
+        CHECK((findNode(head, v) != NULL) == (v >= VALUES));
+    }
+    long live, marked;
+    listSize(head, &live, &marked);
+    CHECK(live == VALUES);
+    checkCounters();
+    cleanupList(head);
+}
+
+static void testCombinedInsert(void) {
+    pthread_t threads[THREADS];
+
+    head = createEmptyList();
+    CHECK(trackListSize(head));
+    combiner = createCombiner(head);
+
+    for (long i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, combinedInserter, (void *)i);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int v = 0; v < VALUES; v++) {
+        CHECK(findNode(head, v) != NULL);
+    }
+    long live, marked;
+    listSize(head, &live, &marked);
+    CHECK(live == VALUES);
+    checkCounters();
+    destroyCombiner(combiner);
+    cleanupList(head);
+}
+
+int main(void) {
+    testInsertDeleteRace();
+    testCombinedInsert();
+    printf("test_regular_ll: OK\n");
+    return 0;
+}